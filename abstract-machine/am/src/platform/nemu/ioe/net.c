@@ -0,0 +1,71 @@
+#include <am.h>
+#include <nemu.h>
+#include <klib.h>
+
+#define NET_PRESENT_ADDR (NET_ADDR + 0x00)
+#define NET_TX_RING_ADDR (NET_ADDR + 0x04)
+#define NET_TX_SIZE_ADDR (NET_ADDR + 0x08)
+#define NET_TX_TAIL_ADDR (NET_ADDR + 0x10)
+#define NET_RX_RING_ADDR (NET_ADDR + 0x14)
+#define NET_RX_SIZE_ADDR (NET_ADDR + 0x18)
+#define NET_RX_HEAD_ADDR (NET_ADDR + 0x1c)
+#define NET_RX_TAIL_ADDR (NET_ADDR + 0x20)
+
+#define NR_DESC 16
+#define FRAME_MAX 2048
+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+} NetDesc;
+
+static NetDesc tx_ring[NR_DESC], rx_ring[NR_DESC];
+static uint8_t tx_buf[NR_DESC][FRAME_MAX], rx_buf[NR_DESC][FRAME_MAX];
+static uint32_t tx_tail = 0, rx_next = 0, rx_tail = 0;
+static bool inited = false;
+
+static void rx_post(uint32_t idx) {
+  rx_ring[idx % NR_DESC].addr = (uintptr_t)rx_buf[idx % NR_DESC];
+  rx_ring[idx % NR_DESC].len = FRAME_MAX;
+}
+
+// NEMU built without the network only maps the present register, which reads
+// 0, so the other registers are only accessed after AM_NET_CONFIG reports it
+// is present.
+void __am_net_config(AM_NET_CONFIG_T *cfg) {
+  cfg->present = inl(NET_PRESENT_ADDR);
+  if (!cfg->present || inited) return;
+  inited = true;
+  outl(NET_TX_RING_ADDR, (uintptr_t)tx_ring);
+  outl(NET_TX_SIZE_ADDR, NR_DESC);
+  outl(NET_RX_RING_ADDR, (uintptr_t)rx_ring);
+  outl(NET_RX_SIZE_ADDR, NR_DESC);
+  for (rx_tail = 0; rx_tail < NR_DESC; rx_tail ++) rx_post(rx_tail);
+  outl(NET_RX_TAIL_ADDR, rx_tail);
+}
+
+void __am_net_status(AM_NET_STATUS_T *stat) {
+  stat->rx_len = (rx_next != inl(NET_RX_HEAD_ADDR) ? rx_ring[rx_next % NR_DESC].len : 0);
+  stat->tx_len = 0; // frames are sent as soon as they are written
+}
+
+void __am_net_tx(AM_NET_TX_T *tx) {
+  uint32_t len = (uint8_t *)tx->buf.end - (uint8_t *)tx->buf.start;
+  if (len > FRAME_MAX) len = FRAME_MAX;
+  uint32_t idx = tx_tail % NR_DESC;
+  memcpy(tx_buf[idx], tx->buf.start, len);
+  tx_ring[idx].addr = (uintptr_t)tx_buf[idx];
+  tx_ring[idx].len = len;
+  outl(NET_TX_TAIL_ADDR, ++ tx_tail);
+}
+
+void __am_net_rx(AM_NET_RX_T *rx) {
+  if (rx_next == inl(NET_RX_HEAD_ADDR)) return;
+  NetDesc *d = &rx_ring[rx_next % NR_DESC];
+  uint32_t size = (uint8_t *)rx->buf.end - (uint8_t *)rx->buf.start;
+  memcpy(rx->buf.start, rx_buf[rx_next % NR_DESC], (d->len < size ? d->len : size));
+  rx_next ++;
+  // give the buffer back to NEMU
+  rx_post(rx_tail);
+  outl(NET_RX_TAIL_ADDR, ++ rx_tail);
+}
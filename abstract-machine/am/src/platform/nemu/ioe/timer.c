@@ -1,18 +1,29 @@
 #include <am.h>
 #include <nemu.h>
 
+#define RTC_US_LO_ADDR (RTC_ADDR + 0x00)
+#define RTC_US_HI_ADDR (RTC_ADDR + 0x04)
+#define RTC_DATE_ADDR  (RTC_ADDR + 0x08)
+#define RTC_TIME_ADDR  (RTC_ADDR + 0x0c)
+
 void __am_timer_init() {
 }
 
 void __am_timer_uptime(AM_TIMER_UPTIME_T *uptime) {
-  uptime->us = 0;
+  // reading the high word latches the whole uptime
+  uint32_t hi = inl(RTC_US_HI_ADDR);
+  uint32_t lo = inl(RTC_US_LO_ADDR);
+  uptime->us = ((uint64_t)hi << 32) | lo;
 }
 
 void __am_timer_rtc(AM_TIMER_RTC_T *rtc) {
-  rtc->second = 0;
-  rtc->minute = 0;
-  rtc->hour   = 0;
-  rtc->day    = 0;
-  rtc->month  = 0;
-  rtc->year   = 1900;
+  // reading the date latches the time
+  uint32_t date = inl(RTC_DATE_ADDR);
+  uint32_t time = inl(RTC_TIME_ADDR);
+  rtc->second = time & 0xff;
+  rtc->minute = (time >> 8) & 0xff;
+  rtc->hour   = time >> 16;
+  rtc->day    = date & 0xff;
+  rtc->month  = (date >> 8) & 0xff;
+  rtc->year   = date >> 16;
 }
@@ -0,0 +1,17 @@
+#include <am.h>
+#include <nemu.h>
+
+#define UART_LSR_ADDR (SERIAL_PORT + 5)
+#define UART_LSR_RX_READY 0x01
+
+void __am_uart_config(AM_UART_CONFIG_T *cfg) {
+  cfg->present = true;
+}
+
+void __am_uart_tx(AM_UART_TX_T *uart) {
+  outb(SERIAL_PORT, uart->data);
+}
+
+void __am_uart_rx(AM_UART_RX_T *uart) {
+  uart->data = (inb(UART_LSR_ADDR) & UART_LSR_RX_READY) ? inb(SERIAL_PORT) : -1;
+}
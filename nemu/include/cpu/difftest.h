@@ -17,6 +17,7 @@
 #define __CPU_DIFFTEST_H__
 
 #include <common.h>
+#include <isa.h>
 #include <difftest-def.h>
 
 #ifdef CONFIG_DIFFTEST
@@ -35,6 +36,30 @@ static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
 
+#if defined(CONFIG_DIFFTEST_BATCH) || defined(CONFIG_DIFFTEST_THREAD)
+void difftest_flush();
+#else
+static inline void difftest_flush() {}
+#endif
+
+#ifdef CONFIG_DIFFTEST_BATCH
+void difftest_log_store(paddr_t addr, int len);
+#endif
+
+#ifdef CONFIG_DIFFTEST_THREAD
+void difftest_record_store(paddr_t addr, int len, word_t data);
+#endif
+
+#ifdef CONFIG_DIFFTEST_MEMHASH
+void difftest_mark_dirty(paddr_t addr, int len);
+void difftest_finish();
+#endif
+
+#ifdef CONFIG_DIFFTEST_HISTORY
+void difftest_history_push(vaddr_t pc, ISADecodeInfo *isa);
+void difftest_history_store(paddr_t addr, int len, word_t data);
+#endif
+
 extern void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction);
 extern void (*ref_difftest_regcpy)(void *dut, bool direction);
 extern void (*ref_difftest_exec)(uint64_t n);
@@ -0,0 +1,43 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_REPLAY_H__
+#define __CPU_REPLAY_H__
+
+#include <cpu/decode.h>
+
+enum { REPLAY_OFF, REPLAY_RECORD, REPLAY_CHECK };
+
+#ifdef CONFIG_REPLAY
+extern int g_replay_mode;
+extern bool g_replay_intr; // an interrupt is taken after the current instruction in the log
+
+void replay_step(Decode *s);
+void replay_record_read(paddr_t addr, int len, word_t data);
+word_t replay_read(paddr_t addr, int len);
+word_t replay_query_intr();
+// Called by a device in the CPU thread after it writes `len` bytes to the
+// memory at `addr`. When checking, these bytes are written from the log,
+// so the devices whose data may differ between runs skip writing them.
+void replay_record_dma(paddr_t addr, uint32_t len);
+#define replay_dma_from_log() (g_replay_mode == REPLAY_CHECK)
+void replay_check_end();
+void replay_finish();
+
+// the accesses from sdb are not a part of the execution
+#define replay_active(mode) (g_replay_mode == (mode) && nemu_state.state == NEMU_RUNNING)
+#endif
+
+#endif
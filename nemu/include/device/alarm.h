@@ -19,6 +19,9 @@
 #define TIMER_HZ 60
 
 typedef void (*alarm_handler_t) ();
+// Call `h` TIMER_HZ times per second of host time. It is a periodic host
+// event, so it runs in the CPU thread, kicked by the alarm thread, or at
+// the instruction counts of the virtual time with CONFIG_ALARM_VIRTUAL.
 void add_alarm_handle(alarm_handler_t h);
 
 #endif
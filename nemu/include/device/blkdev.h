@@ -0,0 +1,50 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_BLKDEV_H__
+#define __DEVICE_BLKDEV_H__
+
+#include <common.h>
+
+// Host backend of the block devices. Accesses go through an LRU write-back
+// cache of the image. With CONFIG_BLKDEV_ASYNC, the requests submitted by
+// blkdev_submit() and blkdev_flush() are served by an I/O thread of the
+// device, and their callbacks are called by the CPU thread in
+// device_update() after completion. If too many requests are in flight,
+// submitting waits for the I/O thread, and may call the callbacks of the
+// completed ones. Otherwise they are completed before returning.
+
+typedef struct BlkDev BlkDev;
+typedef void (*blkdev_callback_t)(void *arg);
+
+// Return NULL if the image can not be opened.
+BlkDev* blkdev_open(const char *name, const char *path);
+uint64_t blkdev_size(BlkDev *dev);
+
+// Read or write `len` bytes at `offset` of the image from or to `buf`.
+// `buf` should not be touched until `done` is called.
+void blkdev_submit(BlkDev *dev, bool is_write, uint64_t offset, uint32_t len,
+    void *buf, blkdev_callback_t done, void *arg);
+// Write back the dirty blocks which are written by the previous requests.
+void blkdev_flush(BlkDev *dev, blkdev_callback_t done, void *arg);
+// Wait for all previous requests, then access the image synchronously.
+void blkdev_rw(BlkDev *dev, bool is_write, uint64_t offset, uint32_t len, void *buf);
+
+void blkdev_update();
+// Write back all dirty blocks and close the images. This is called at exit,
+// and also when NEMU aborts, since atexit() handlers do not run then.
+void blkdev_exit();
+
+#endif
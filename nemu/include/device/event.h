@@ -0,0 +1,42 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+// The clock of an event. Deadlines and periods are measured in guest
+// instructions for EVENT_INST, and in microseconds for EVENT_HOST.
+enum { EVENT_INST, EVENT_HOST, NR_EVENT_CLOCK };
+
+typedef void (*event_handler_t) ();
+
+// Call `h` after `delay` units of `clock`, and then every `period` units.
+// The event is one-shot if `period` is 0.
+void event_add(const char *name, int clock, uint64_t delay, uint64_t period, event_handler_t h);
+void event_cancel(event_handler_t h);
+void event_update();
+void event_kick();
+uint64_t event_host_time();
+
+// The number of guest instructions at which event_update() should be called.
+extern uint64_t event_deadline;
+
+static inline bool event_due(uint64_t nr_inst) {
+  return nr_inst >= __atomic_load_n(&event_deadline, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,45 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_INTR_H__
+#define __DEVICE_INTR_H__
+
+#include <common.h>
+
+// Interrupt lines into the CPU. Each ISA maps them to its own causes
+// in isa_query_intr().
+#define INTR_LINE_TIMER (1u << 0)
+#define INTR_LINE_SOFT  (1u << 1)
+#define INTR_LINE_EXT   (1u << 2)
+
+// Sources of external interrupts. 0 is reserved by the PLIC.
+enum {
+  IRQ_NONE,
+  IRQ_DISK,
+  IRQ_NET,
+  IRQ_VIRTIO_BLK,
+  IRQ_VIRTIO_CONSOLE,
+  NR_IRQ = 32
+};
+
+// The asserted lines. The CPU loop only queries the ISA when it is nonzero.
+extern uint32_t g_intr_lines;
+
+void intr_set_line(uint32_t line, bool level);
+// Level-triggered: a device keeps its line high until the guest acknowledges it.
+void dev_set_irq(int irq, bool level);
+void dev_raise_intr();
+
+#endif
@@ -21,6 +21,20 @@
 typedef void(*io_callback_t)(uint32_t, int, bool);
 uint8_t* new_space(int size);
 
+#ifdef CONFIG_DEVICE_PROFILE
+#define NR_PROFILE_BUCKET 24
+
+typedef struct {
+  uint64_t nr[2];    // number of reads and writes
+  uint64_t bytes[2]; // bytes of reads and writes
+  uint64_t ns;       // host time spent in the callback
+  // hist[i] counts the callbacks taking [2^i, 2^(i+1)) ns, and the last bucket
+  // also counts the longer ones
+  uint64_t hist[NR_PROFILE_BUCKET];
+  uint64_t last_nr, last_ns; // at the last report of the rates
+} IOProfile;
+#endif
+
 typedef struct {
   const char *name;
   // we treat ioaddr_t as paddr_t here
@@ -28,6 +42,9 @@ typedef struct {
   paddr_t high;
   void *space;
   io_callback_t callback;
+#ifdef CONFIG_DEVICE_PROFILE
+  IOProfile prof;
+#endif
 } IOMap;
 
 static inline bool map_inside(IOMap *map, paddr_t addr) {
@@ -50,6 +67,19 @@ void add_pio_map(const char *name, ioaddr_t addr,
 void add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 
+#ifdef CONFIG_DEVICE_PROFILE
+void map_profile_add(IOMap *map);
+void map_profile_callback(IOMap *map, paddr_t offset, int len, bool is_write);
+#endif
+
+static inline void map_invoke_callback(IOMap *map, paddr_t offset, int len, bool is_write) {
+#ifdef CONFIG_DEVICE_PROFILE
+  map_profile_callback(map, offset, len, is_write);
+#else
+  if (map->callback != NULL) map->callback(offset, len, is_write);
+#endif
+}
+
 word_t map_read(paddr_t addr, int len, IOMap *map);
 void map_write(paddr_t addr, int len, word_t data, IOMap *map);
 
@@ -0,0 +1,47 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_VGA_SHM_H__
+#define __DEVICE_VGA_SHM_H__
+
+#include <stdint.h>
+
+// Layout of the shared memory object exported by VGA when CONFIG_VGA_SHM
+// is enabled. The object is named CONFIG_VGA_SHM_NAME-<pid of NEMU>, and is
+// removed when NEMU exits. The header takes the first page, and is followed
+// by the frame buffer in ARGB8888 with `width * 4` bytes per line. The frame
+// buffer is the one written by the guest, so it may be in the middle of
+// drawing the next frame, just like a real scanout without vsync.
+//
+// The header is protected by a seqlock. A reader should
+//   1. load `seq` with acquire, and retry if it is odd;
+//   2. read the other fields (and the pixels if desired);
+//   3. issue an acquire fence and load `seq` again, and retry if it changed.
+// `frame` increases each time the guest writes the sync register, so a
+// viewer or a recorder can poll it to find new frames.
+
+#define VGA_SHM_MAGIC 0x4147564e // "NVGA"
+#define VGA_SHM_HEADER_SIZE 4096
+
+typedef struct {
+  uint32_t magic;
+  uint32_t width, height;
+  uint32_t seq;
+  uint64_t frame;
+  uint64_t sync_inst; // number of guest instructions at the last sync
+  uint64_t sync_us;   // host time at the last sync
+} VGAShmHeader;
+
+#endif
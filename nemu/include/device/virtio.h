@@ -0,0 +1,91 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_VIRTIO_H__
+#define __DEVICE_VIRTIO_H__
+
+#include <device/map.h>
+
+// https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+// Only the virtio-mmio transport (version 2) with split virtqueues is supported.
+
+#define VIRTIO_ID_BLOCK   2
+#define VIRTIO_ID_CONSOLE 3
+
+#define VIRTIO_F_VERSION_1 32
+
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+
+#define VIRTIO_MAX_QUEUE 2
+#define VIRTQ_MAX_SIZE 256
+#define VIRTIO_MMIO_SIZE 0x200
+
+typedef struct {
+  uint32_t num;
+  bool ready;
+  uint64_t desc, avail, used;
+  uint16_t last_avail_idx;
+} VirtQueue;
+
+// One element of a descriptor chain. `write` means device-writable.
+typedef struct {
+  paddr_t addr;
+  uint32_t len;
+  bool write;
+} VirtqBuf;
+
+typedef struct {
+  uint16_t head;
+  int nr_buf;
+  VirtqBuf buf[VIRTQ_MAX_SIZE];
+} VirtqElem;
+
+typedef struct VirtioDev {
+  const char *name;
+  uint32_t device_id;
+  int irq;
+  uint64_t features;
+  int nr_queue;
+  // called when the driver notifies the queue
+  void (*notify)(struct VirtioDev *dev, int q);
+  uint8_t *config;
+  uint32_t config_size;
+
+  // state of the transport
+  uint32_t *base;
+  uint32_t status;
+  uint32_t device_features_sel, driver_features_sel;
+  uint64_t driver_features;
+  uint32_t queue_sel;
+  uint32_t intr_status;
+  VirtQueue vq[VIRTIO_MAX_QUEUE];
+} VirtioDev;
+
+void virtio_mmio_init(VirtioDev *dev, paddr_t addr, io_callback_t callback);
+void virtio_mmio_access(VirtioDev *dev, uint32_t offset, int len, bool is_write);
+
+bool virtq_pop(VirtioDev *dev, int q, VirtqElem *elem);
+void virtq_push(VirtioDev *dev, int q, VirtqElem *elem, uint32_t len);
+void virtio_notify(VirtioDev *dev);
+// The driver breaks the protocol, so stop serving the device until it is reset.
+void virtio_fail(VirtioDev *dev, const char *reason);
+
+uint8_t* virtio_guest_ptr(paddr_t addr, uint32_t len);
+void virtio_guest_write(paddr_t addr, const void *buf, uint32_t len);
+
+#endif
@@ -17,6 +17,7 @@
 #define __DIFFTEST_DEF_H__
 
 #include <stdint.h>
+#include <string.h>
 #include <macro.h>
 #include <generated/autoconf.h>
 
@@ -37,4 +38,21 @@ enum { DIFFTEST_TO_DUT, DIFFTEST_TO_REF };
 # error Unsupport ISA
 #endif
 
+// The hash of memory used to compare the memory of DUT and REF. A REF may
+// export `uint64_t difftest_memhash(paddr_t addr, size_t n)` to return the
+// hash of its memory in [addr, addr + n) without copying it to DUT.
+static inline uint64_t difftest_hash(const void *buf, size_t n) {
+  const uint8_t *p = (const uint8_t *)buf;
+  uint64_t h = 0xcbf29ce484222325ull;
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0x100000001b3ull;
+    h ^= h >> 32;
+  }
+  for (; i < n; i ++) h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
 #endif
@@ -54,5 +54,9 @@ word_t isa_query_intr();
 // difftest
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc);
 void isa_difftest_attach();
+// the index of the register written by the instruction in the registers
+// copied by difftest, or -1 if it writes none
+int isa_difftest_dest_reg(ISADecodeInfo *s);
+const char* isa_difftest_reg_name(int idx);
 
 #endif
@@ -16,6 +16,9 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/replay.h>
+#include <device/event.h>
+#include <device/intr.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -31,13 +34,23 @@ static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
 void device_update();
+void sdcard_statistic(uint64_t host_us);
+void net_statistic();
+void pio_statistic();
+void blkdev_statistic();
+void blkdev_exit();
+void map_profile_dump();
+void serial_flush();
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE_COND
   if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
 #endif
   if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
+  IFDEF(CONFIG_REPLAY, if (g_replay_mode != REPLAY_OFF) replay_step(_this));
+  IFDEF(CONFIG_DIFFTEST_HISTORY, difftest_history_push(_this->pc, &_this->isa));
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  IFDEF(CONFIG_DIFFTEST_PER_BLOCK, if (_this->dnpc != _this->snpc) difftest_flush());
 }
 
 static void exec_once(Decode *s, vaddr_t pc) {
@@ -78,22 +91,56 @@ static void execute(uint64_t n) {
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+#ifdef CONFIG_DEVICE
+    if (event_due(g_nr_guest_inst)) {
+      // devices may copy data to the reference design
+      difftest_flush();
+      device_update();
+    }
+#endif
+#ifdef CONFIG_DEVICE
+    if (unlikely(g_intr_lines != 0 || MUXDEF(CONFIG_REPLAY, g_replay_intr, false))) {
+      word_t intr = MUXDEF(CONFIG_REPLAY, replay_query_intr(), isa_query_intr());
+      if (intr != INTR_EMPTY) {
+        difftest_flush();
+        IFDEF(CONFIG_DIFFTEST, ref_difftest_raise_intr(intr));
+        cpu.pc = isa_raise_intr(intr, cpu.pc);
+        difftest_flush(); // take the interrupt into the checkpoint
+      }
+    }
+#endif
+  }
+}
+
+// Execute `n` instructions without tracing, difftest and devices.
+// This is used by difftest to replay the instructions of a batch.
+void cpu_exec_quiet(uint64_t n) {
+  Decode s;
+  for (; n > 0; n --) {
+    exec_once(&s, cpu.pc);
+    IFDEF(CONFIG_DIFFTEST_HISTORY, difftest_history_push(s.pc, &s.isa));
   }
 }
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
-#define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
   Log("host time spent = " NUMBERIC_FMT " us", g_timer);
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
   if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+  IFDEF(CONFIG_HAS_SDCARD, sdcard_statistic(g_timer));
+  IFDEF(CONFIG_HAS_NET, net_statistic());
+  IFDEF(CONFIG_HAS_PORT_IO, pio_statistic());
+  IFDEF(CONFIG_BLKDEV, blkdev_statistic());
+  IFDEF(CONFIG_DEVICE_PROFILE, map_profile_dump());
 }
 
 void assert_fail_msg() {
+  IFDEF(CONFIG_SERIAL_BUFFERED, serial_flush());
   isa_reg_display();
   statistic();
+  IFDEF(CONFIG_REPLAY, replay_finish());
+  IFDEF(CONFIG_BLKDEV, blkdev_exit());
 }
 
 /* Simulate how the CPU works. */
@@ -109,6 +156,12 @@ void cpu_exec(uint64_t n) {
   uint64_t timer_start = get_time();
 
   execute(n);
+  difftest_flush();
+  if (nemu_state.state == NEMU_END || nemu_state.state == NEMU_ABORT) {
+    IFDEF(CONFIG_DIFFTEST_MEMHASH, difftest_finish());
+  }
+  IFDEF(CONFIG_REPLAY, if (nemu_state.state == NEMU_END) replay_check_end());
+  IFDEF(CONFIG_SERIAL_BUFFERED, serial_flush());
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -123,6 +176,8 @@ void cpu_exec(uint64_t n) {
             ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
           nemu_state.halt_pc);
       // fall through
-    case NEMU_QUIT: statistic();
+    case NEMU_QUIT:
+      statistic();
+      IFDEF(CONFIG_REPLAY, replay_finish());
   }
 }
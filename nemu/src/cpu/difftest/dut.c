@@ -18,8 +18,15 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/host.h>
 #include <utils.h>
 #include <difftest-def.h>
+#ifdef CONFIG_DIFFTEST_THREAD
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
@@ -30,10 +37,623 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
+static bool mismatched = false;
+
+#ifdef CONFIG_DIFFTEST_THREAD
+#define RING_SIZE 1024 // number of records in the ring of the REF thread
+#endif
+
+static void checkregs(CPU_state *ref, vaddr_t pc);
+static void abort_difftest(vaddr_t pc, CPU_state *ref);
+
+// The data of a store is in the low `len` bytes of a word.
+static inline word_t store_mask(int len) {
+  return (len == sizeof(word_t) ? (word_t)-1 : ((word_t)1 << (len * 8)) - 1);
+}
+
+#ifdef CONFIG_DIFFTEST_HISTORY
+// The ring of the instructions retired recently by DUT, with the register
+// and the memory written by each of them. It is reported on a mismatch,
+// and the disassembly is only generated at that time. DUT may run ahead of
+// the mismatch by a whole batch, or by the ring of the REF thread, so the
+// ring also has room for them, and one more for the instruction executing.
+#define HIST_SIZE CONFIG_DIFFTEST_HISTORY_SIZE
+#define HIST_RING (HIST_SIZE + 1 + MUXDEF(CONFIG_DIFFTEST_BATCH, CONFIG_DIFFTEST_BATCH_SIZE, \
+      MUXDEF(CONFIG_DIFFTEST_THREAD, RING_SIZE, 0)))
+#define NR_DIFFTEST_REG (DIFFTEST_REG_SIZE / sizeof(word_t))
+
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  int8_t rd;      // index of the register written, or -1
+  uint8_t st_len; // length of the last store, or 0 if there is no store
+  word_t rd_val;
+  paddr_t st_addr;
+  word_t st_data;
+} HistEntry;
+
+static HistEntry hist[HIST_RING];
+static uint64_t nr_hist = 0;
+static uint32_t hist_cur = 0; // nr_hist % HIST_RING
+// The instructions before `hist_rewind_to` are kept only if they are not
+// before `hist_valid`, since DUT may have run further before rewinding.
+static uint64_t hist_valid = 0;
+static uint64_t hist_rewind_to = 0;
+
+void difftest_history_store(paddr_t addr, int len, word_t data) {
+  HistEntry *e = &hist[hist_cur];
+  e->st_addr = addr;
+  e->st_len = len;
+  e->st_data = data & store_mask(len);
+}
+
+void difftest_history_push(vaddr_t pc, ISADecodeInfo *isa) {
+  HistEntry *e = &hist[hist_cur];
+  int rd = isa_difftest_dest_reg(isa);
+  e->pc = pc;
+  e->inst = isa->inst.val;
+  e->rd = rd;
+  if (rd >= 0) e->rd_val = ((word_t *)&cpu)[rd];
+  nr_hist ++;
+  hist_cur = (hist_cur + 1 == HIST_RING ? 0 : hist_cur + 1);
+  hist[hist_cur].st_len = 0;
+}
+
+#if defined(CONFIG_DIFFTEST_BATCH) || defined(CONFIG_DIFFTEST_THREAD)
+// Drop the instructions since the `to`-th one, which are replayed later,
+// or are run by DUT after the mismatch.
+static void history_rewind(uint64_t to) {
+  if (nr_hist <= to) return;
+  if (nr_hist >= HIST_RING && nr_hist - HIST_RING + 1 > hist_valid) hist_valid = nr_hist - HIST_RING + 1;
+  hist_rewind_to = to;
+  nr_hist = to;
+  hist_cur = nr_hist % HIST_RING;
+  hist[hist_cur].st_len = 0;
+}
+#endif
+
+static void history_disasm(char *buf, int size, HistEntry *e) {
+#if defined(CONFIG_ITRACE) && !defined(CONFIG_ISA_loongarch32r)
+  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+  disassemble(buf, size, e->pc, (uint8_t *)&e->inst, sizeof(e->inst));
+  char *p;
+  for (p = buf; *p != '\0'; p ++) if (*p == '\t') *p = ' ';
+#else
+  buf[0] = '\0';
+#endif
+}
+
+static void history_dump_json(vaddr_t pc, CPU_state *ref, uint64_t start) {
+  const char *path = CONFIG_DIFFTEST_HISTORY_JSON;
+  if (path[0] == '\0') return;
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) { Log("Can not open %s to dump the difftest report", path); return; }
+
+  char buf[128];
+  uint64_t i;
+  fprintf(fp, "{\n  \"pc\": %" PRIu64 ",\n  \"instructions\": [", (uint64_t)pc);
+  for (i = start; i < nr_hist; i ++) {
+    HistEntry *e = &hist[i % HIST_RING];
+    history_disasm(buf, sizeof(buf), e);
+    fprintf(fp, "%s\n    {\"pc\": %" PRIu64 ", \"inst\": %" PRIu32 ", \"disasm\": \"%s\"",
+        (i == start ? "" : ","), (uint64_t)e->pc, e->inst, buf);
+    if (e->rd >= 0) {
+      fprintf(fp, ", \"rd\": \"%s\", \"rd_val\": %" PRIu64,
+          isa_difftest_reg_name(e->rd), (uint64_t)e->rd_val);
+    }
+    if (e->st_len != 0) {
+      fprintf(fp, ", \"store\": {\"addr\": %" PRIu64 ", \"len\": %d, \"data\": %" PRIu64 "}",
+          (uint64_t)e->st_addr, e->st_len, (uint64_t)e->st_data);
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  ],\n  \"registers\": [");
+  for (i = 0; i < NR_DIFFTEST_REG; i ++) {
+    word_t dut = ((word_t *)&cpu)[i], r = ((word_t *)ref)[i];
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"dut\": %" PRIu64 ", \"ref\": %" PRIu64 ", \"diff\": %s}",
+        (i == 0 ? "" : ","), isa_difftest_reg_name(i), (uint64_t)dut, (uint64_t)r,
+        (dut == r ? "false" : "true"));
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  Log("difftest report is dumped to %s", path);
+}
+
+// Print the instructions in the ring, and the registers of DUT and REF
+// side by side, with the different ones highlighted.
+static void history_report(vaddr_t pc, CPU_state *ref) {
+  uint64_t start = (hist_valid < hist_rewind_to ? hist_valid : hist_rewind_to);
+  if (nr_hist > HIST_SIZE && nr_hist - HIST_SIZE > start) start = nr_hist - HIST_SIZE;
+
+  char buf[128];
+  uint64_t i;
+  printf("the last %" PRIu64 " instructions retired by DUT:\n", nr_hist - start);
+  for (i = start; i < nr_hist; i ++) {
+    HistEntry *e = &hist[i % HIST_RING];
+    history_disasm(buf, sizeof(buf), e);
+    printf(FMT_WORD ": %08" PRIx32, e->pc, e->inst);
+    if (buf[0] != '\0') printf("  %-28s", buf);
+    if (e->rd >= 0) printf("  %s = " FMT_WORD, isa_difftest_reg_name(e->rd), e->rd_val);
+    if (e->st_len != 0) printf("  mem[" FMT_PADDR "] <- " FMT_WORD " (%d bytes)", e->st_addr, e->st_data, e->st_len);
+    printf("\n");
+  }
+
+  printf("registers after executing instruction at pc = " FMT_WORD ":\n", pc);
+  printf("%-8s %-*s  %s\n", "", (int)sizeof(word_t) * 2 + 2, "DUT", "REF");
+  for (i = 0; i < NR_DIFFTEST_REG; i ++) {
+    word_t dut = ((word_t *)&cpu)[i], r = ((word_t *)ref)[i];
+    if (dut == r) printf("%-8s " FMT_WORD "  " FMT_WORD "\n", isa_difftest_reg_name(i), dut, r);
+    else printf(ANSI_FMT("%-8s " FMT_WORD "  " FMT_WORD, ANSI_FG_RED) "\n", isa_difftest_reg_name(i), dut, r);
+  }
+  history_dump_json(pc, ref, start);
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_MEMHASH
+// The pages written by DUT since the last memory check. Only these pages
+// are compared, so the cost of a check is proportional to the number of
+// pages written.
+#define MH_PAGE_SHIFT 12
+#define MH_PAGE_SIZE (1u << MH_PAGE_SHIFT)
+#define MH_NR_PAGE (CONFIG_MSIZE >> MH_PAGE_SHIFT)
+
+static uint64_t (*ref_difftest_memhash)(paddr_t addr, size_t n) = NULL;
+static uint64_t dirty_map[(MH_NR_PAGE + 63) / 64];
+static uint32_t dirty_list[MH_NR_PAGE];
+static uint32_t nr_dirty = 0;
+static uint64_t nr_inst_unchecked = 0;
+
+static inline void mark_page(paddr_t addr) {
+  uint32_t idx = (addr - CONFIG_MBASE) >> MH_PAGE_SHIFT;
+  uint64_t mask = 1ull << (idx % 64);
+  if (dirty_map[idx / 64] & mask) return;
+  dirty_map[idx / 64] |= mask;
+  dirty_list[nr_dirty ++] = idx;
+}
+
+void difftest_mark_dirty(paddr_t addr, int len) {
+  mark_page(addr);
+  mark_page(addr + len - 1);
+}
+
+static uint64_t ref_page_hash(paddr_t addr, uint8_t *buf) {
+  if (ref_difftest_memhash != NULL) return ref_difftest_memhash(addr, MH_PAGE_SIZE);
+  ref_difftest_memcpy(addr, buf, MH_PAGE_SIZE, DIFFTEST_TO_DUT);
+  return difftest_hash(buf, MH_PAGE_SIZE);
+}
+
+// Compare the dirty pages, and return whether they are the same in DUT and REF.
+static bool memcheck() {
+  static uint8_t ref_page[MH_PAGE_SIZE];
+  bool ok = true;
+  uint32_t i;
+  for (i = 0; i < nr_dirty; i ++) {
+    uint32_t idx = dirty_list[i];
+    dirty_map[idx / 64] &= ~(1ull << (idx % 64));
+    if (!ok) continue;
+    paddr_t addr = CONFIG_MBASE + ((paddr_t)idx << MH_PAGE_SHIFT);
+    uint8_t *dut = guest_to_host(addr);
+    if (ref_page_hash(addr, ref_page) == difftest_hash(dut, MH_PAGE_SIZE)) continue;
+
+    ok = false;
+    ref_difftest_memcpy(addr, ref_page, MH_PAGE_SIZE, DIFFTEST_TO_DUT);
+    uint32_t off;
+    for (off = 0; off < MH_PAGE_SIZE && ref_page[off] == dut[off]; off ++);
+    if (off == MH_PAGE_SIZE) Log("memory hash of page " FMT_PADDR " is different, but the data is the same", addr);
+    else {
+      off &= ~(sizeof(word_t) - 1);
+      Log("memory at " FMT_PADDR " is different, right = " FMT_WORD ", wrong = " FMT_WORD,
+          addr + off, (word_t)host_read(ref_page + off, sizeof(word_t)),
+          (word_t)host_read(dut + off, sizeof(word_t)));
+    }
+  }
+  nr_dirty = 0;
+  return ok;
+}
+
+// Check memory if enough instructions are executed since the last check.
+// DUT and REF should agree on the registers when this is called.
+static void memhash_step(vaddr_t pc, uint64_t n) {
+  nr_inst_unchecked += n;
+  if (nr_inst_unchecked < CONFIG_DIFFTEST_MEMHASH_INTERVAL) return;
+  nr_inst_unchecked = 0;
+  if (!memcheck() && nemu_state.state != NEMU_ABORT) abort_difftest(pc, &cpu);
+}
+
+// Check the pages written since the last check when the execution ends, so
+// that the stores of the last instructions are also compared. This is
+// skipped if REF is already different.
+void difftest_finish() {
+  if (skip_dut_nr_inst > 0 || mismatched) return;
+  nr_inst_unchecked = 0;
+  if (!memcheck() && nemu_state.state != NEMU_ABORT) abort_difftest(cpu.pc, &cpu);
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_BATCH
+// In batch mode, REF runs the instructions of the current batch at once when
+// the batch ends. DUT and REF agree at the checkpoint, which is the beginning
+// of the batch. The stores to pmem since the checkpoint are recorded in the
+// undo log, so that DUT can be restored to the checkpoint on a mismatch.
+#define BATCH_SIZE CONFIG_DIFFTEST_BATCH_SIZE
+#define NR_UNDO (BATCH_SIZE * 4)
+
+typedef struct {
+  paddr_t addr;
+  int len;
+  word_t data;
+} UndoEntry;
+
+static UndoEntry undo_log[NR_UNDO];
+static int nr_undo = 0;
+static vaddr_t batch_npc[BATCH_SIZE]; // pc after each instruction of the batch
+// optional, let REF run the batch natively until reaching a pc
+static void (*ref_difftest_exec_to)(uint64_t n, uint64_t pc, uint64_t nr_hit) = NULL;
+static CPU_state ckpt; // DUT registers at the checkpoint
+static CPU_state last; // DUT registers before the current instruction
+#ifdef CONFIG_DIFFTEST_HISTORY
+static uint64_t hist_ckpt = 0; // number of instructions retired at the checkpoint
+#endif
+static uint64_t nr_pending = 0; // number of instructions since the checkpoint
+static bool replaying = false;
+
+void difftest_log_store(paddr_t addr, int len) {
+  Assert(nr_undo < NR_UNDO, "undo log of difftest is full");
+  undo_log[nr_undo ++] = (UndoEntry){ .addr = addr, .len = len,
+    .data = host_read(guest_to_host(addr), len) };
+}
+
+static void checkpoint() {
+  ckpt = cpu;
+  last = cpu;
+  nr_pending = 0;
+  nr_undo = 0;
+  IFDEF(CONFIG_DIFFTEST_HISTORY, hist_ckpt = nr_hist);
+}
+
+// The stores in the undo log are coalesced into ranges within pages, so that
+// REF is accessed once for each page written, but not each store.
+#define RANGE_SHIFT 12
+
+typedef struct {
+  paddr_t lo, hi;
+} MemRange;
+
+static MemRange ranges[NR_UNDO];
+
+static int collect_ranges() {
+  int n = 0, i, j;
+  for (i = 0; i < nr_undo; i ++) {
+    UndoEntry *e = &undo_log[i];
+    paddr_t lo = e->addr, hi = e->addr + e->len;
+    // the recent pages are more likely to be written again
+    for (j = n - 1; j >= 0 && (ranges[j].lo >> RANGE_SHIFT) != (lo >> RANGE_SHIFT); j --);
+    if (j < 0) ranges[n ++] = (MemRange){ .lo = lo, .hi = hi };
+    else {
+      if (lo < ranges[j].lo) ranges[j].lo = lo;
+      if (hi > ranges[j].hi) ranges[j].hi = hi;
+    }
+  }
+  return n;
+}
+
+static void copy_ranges_to_ref(int n) {
+  int i;
+  for (i = 0; i < n; i ++) {
+    ref_difftest_memcpy(ranges[i].lo, guest_to_host(ranges[i].lo), ranges[i].hi - ranges[i].lo, DIFFTEST_TO_REF);
+  }
+}
+
+// After DUT and REF diverge, REF may write memory which is not written by
+// DUT, so the whole memory is copied to REF when restoring it next time.
+static bool ref_diverged = false;
+
+// Restore both DUT and REF to the checkpoint.
+static void restore() {
+  int n = collect_ranges();
+  while (nr_undo > 0) {
+    UndoEntry *e = &undo_log[-- nr_undo];
+    host_write(guest_to_host(e->addr), e->len, e->data);
+  }
+  cpu = ckpt;
+  IFDEF(CONFIG_DIFFTEST_HISTORY, history_rewind(hist_ckpt));
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  if (ref_diverged) ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  else copy_ranges_to_ref(n);
+  ref_diverged = false;
+}
+
+// Restore REF to the checkpoint, but keep DUT unchanged. This is called
+// after REF diverges, so the whole memory is copied.
+static void restore_ref() {
+  static word_t redo[NR_UNDO];
+  int i;
+  for (i = nr_undo - 1; i >= 0; i --) {
+    UndoEntry *e = &undo_log[i];
+    redo[i] = host_read(guest_to_host(e->addr), e->len);
+    host_write(guest_to_host(e->addr), e->len, e->data);
+  }
+  ref_difftest_regcpy(&ckpt, DIFFTEST_TO_REF);
+  ref_difftest_memcpy(PMEM_LEFT, guest_to_host(PMEM_LEFT), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  for (i = 0; i < nr_undo; i ++) {
+    UndoEntry *e = &undo_log[i];
+    host_write(guest_to_host(e->addr), e->len, redo[i]);
+  }
+}
+
+// Return the first store since the checkpoint whose data in REF is
+// different from DUT, or NULL if there is no such store.
+static UndoEntry* check_stores() {
+  static uint8_t buf[(1 << RANGE_SHIFT) + sizeof(word_t)];
+  int n = collect_ranges(), i;
+  for (i = 0; i < n; i ++) {
+    uint32_t len = ranges[i].hi - ranges[i].lo;
+    ref_difftest_memcpy(ranges[i].lo, buf, len, DIFFTEST_TO_DUT);
+    if (memcmp(buf, guest_to_host(ranges[i].lo), len) != 0) break;
+  }
+  if (i == n) return NULL;
+
+  // find the store, since the bytes between the stores in a range are also compared
+  for (i = 0; i < nr_undo; i ++) {
+    UndoEntry *e = &undo_log[i];
+    word_t ref = 0;
+    ref_difftest_memcpy(e->addr, &ref, e->len, DIFFTEST_TO_DUT);
+    if (ref != host_read(guest_to_host(e->addr), e->len)) return e;
+  }
+  return NULL;
+}
+
+// Since only the state at the end of a batch is compared, a difference
+// which is overwritten before that can not be found.
+static bool agree(CPU_state *ref_r, CPU_state *dut) {
+  return memcmp(ref_r, dut, DIFFTEST_REG_SIZE) == 0 && check_stores() == NULL;
+}
+
+// Run both sides `n` instructions from the checkpoint,
+// and return whether they agree.
+static bool replay(uint64_t n, CPU_state *ref_r) {
+  restore();
+  replaying = true;
+  cpu_exec_quiet(n);
+  replaying = false;
+  ref_difftest_exec(n);
+  ref_difftest_regcpy(ref_r, DIFFTEST_TO_DUT);
+  bool ok = agree(ref_r, &cpu);
+  if (!ok) ref_diverged = true;
+  return ok;
+}
+
+// DUT and REF agree at the checkpoint, but not after `n` instructions.
+// Find the first instruction making them different, and report it as
+// comparing after every instruction.
+static void bisect(uint64_t n) {
+  CPU_state ref_r;
+  uint64_t lo = 0, hi = n; // they agree after `lo` instructions, but not after `hi`
+  ref_diverged = true;
+  if (replay(hi, &ref_r)) panic("difftest: the mismatch can not be reproduced by replaying the batch");
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (replay(mid, &ref_r)) lo = mid;
+    else hi = mid;
+  }
+  replay(lo, &ref_r);
+  vaddr_t pc = cpu.pc;
+  int nr_undo_before = nr_undo;
+  replaying = true;
+  cpu_exec_quiet(1);
+  replaying = false;
+  ref_difftest_exec(1);
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  Log("difftest: the first mismatch is found at instruction %" PRIu64 " of %" PRIu64 " in the batch", hi, n);
+  checkregs(&ref_r, pc);
+  UndoEntry *e = check_stores();
+  if (e != NULL) {
+    assert(e - undo_log >= nr_undo_before);
+    word_t ref = 0;
+    ref_difftest_memcpy(e->addr, &ref, e->len, DIFFTEST_TO_DUT);
+    Log("memory at " FMT_PADDR " is different after executing instruction at pc = " FMT_WORD
+        ", right = " FMT_WORD ", wrong = " FMT_WORD, e->addr, pc, ref,
+        (word_t)host_read(guest_to_host(e->addr), e->len));
+    if (nemu_state.state != NEMU_ABORT) abort_difftest(pc, &ref_r);
+  }
+}
+
+// Let REF catch up with the pending instructions, and compare it with
+// `dut`, which is the DUT registers after these instructions.
+static void batch_check(CPU_state *dut) {
+  if (nr_pending == 0 || replaying) return;
+  CPU_state ref_r;
+  if (ref_difftest_exec_to != NULL) {
+    uint64_t i, nr_hit = 0;
+    for (i = 0; i < nr_pending; i ++) nr_hit += (batch_npc[i] == dut->pc);
+    ref_difftest_exec_to(nr_pending, dut->pc, nr_hit);
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    if (!agree(&ref_r, dut)) {
+      // Running natively may be different from single-stepping,
+      // so check the batch again by single-stepping. Restoring REF
+      // copies the whole memory, so later batches are single-stepped.
+      Log("The reference design differs when running natively at pc = " FMT_WORD
+          ", so the later batches are single-stepped", dut->pc);
+      ref_difftest_exec_to = NULL;
+      restore_ref();
+      ref_difftest_exec(nr_pending);
+      ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    }
+  } else {
+    ref_difftest_exec(nr_pending);
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  }
+  if (!agree(&ref_r, dut)) bisect(nr_pending);
+  nr_pending = 0;
+}
+
+// End the current batch.
+void difftest_flush() {
+  if (skip_dut_nr_inst > 0 || nemu_state.state == NEMU_ABORT) return;
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, uint64_t n = nr_pending);
+  batch_check(&cpu);
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, if (nemu_state.state != NEMU_ABORT) memhash_step(cpu.pc, n));
+  checkpoint();
+}
+#endif
+
+#ifdef CONFIG_DIFFTEST_THREAD
+// REF runs on its own thread. After each instruction, DUT publishes its
+// registers and the stores of the instruction into a single-producer
+// single-consumer ring, and the REF thread runs the same instruction and
+// verifies them. DUT only waits for REF when the ring is full, and before
+// anything which accesses REF directly, such as skipping an instruction,
+// raising an interrupt, or copying data from devices to REF.
+#define MAX_STORE 8
+#define PUBLISH_INTERVAL 32
+
+typedef struct {
+  paddr_t addr;
+  int len;
+  word_t data; // masked by `len`
+} StoreRecord;
+
+typedef struct {
+  vaddr_t pc;
+  int nr_store;
+  StoreRecord store[MAX_STORE];
+  uint8_t regs[DIFFTEST_REG_SIZE]; // DUT registers after the instruction
+#ifdef CONFIG_DIFFTEST_HISTORY
+  uint64_t nr_hist; // number of instructions retired after the instruction
+#endif
+} InstRecord;
+
+static InstRecord ring[RING_SIZE];
+// The indices are published every PUBLISH_INTERVAL records, to reduce
+// the traffic of the cache lines holding them between the threads.
+static _Atomic uint64_t ring_head = 0; // published by DUT
+static _Atomic uint64_t ring_tail = 0; // published by the REF thread
+static _Atomic bool ref_failed = false;
+static uint64_t head = 0;       // the next record to write, private to DUT
+static uint64_t tail_seen = 0;  // the last tail seen by DUT
+static CPU_state fail_ref;      // REF registers after the mismatched instruction
+static int fail_store = -1;     // index of the mismatched store, or -1
+static StoreRecord cur_store[MAX_STORE]; // stores of the current instruction
+static int nr_cur_store = 0;
+static uint64_t nr_inst_synced = 0;
+
+void difftest_record_store(paddr_t addr, int len, word_t data) {
+  Assert(nr_cur_store < MAX_STORE, "the instruction at pc = " FMT_WORD
+      " stores more than %d times, increase MAX_STORE", cpu.pc, MAX_STORE);
+  cur_store[nr_cur_store ++] = (StoreRecord){ .addr = addr, .len = len, .data = data & store_mask(len) };
+}
+
+static void wait_a_while(int *spin) {
+  (*spin) ++;
+  if (*spin < 256) return;
+  if (*spin < 65536) sched_yield();
+  else usleep(50);
+}
+
+static bool ref_check(InstRecord *r) {
+  ref_difftest_exec(1);
+  ref_difftest_regcpy(&fail_ref, DIFFTEST_TO_DUT);
+  if (memcmp(&fail_ref, r->regs, DIFFTEST_REG_SIZE) != 0) return false;
+  int i;
+  for (i = 0; i < r->nr_store; i ++) {
+    StoreRecord *st = &r->store[i];
+    word_t ref = 0;
+    ref_difftest_memcpy(st->addr, &ref, st->len, DIFFTEST_TO_DUT);
+    if (ref != st->data) { fail_store = i; return false; }
+  }
+  return true;
+}
+
+static void* ref_thread(void *arg) {
+  uint64_t tail = 0;
+  while (true) {
+    int spin = 0;
+    uint64_t h;
+    while ((h = atomic_load_explicit(&ring_head, memory_order_acquire)) == tail) wait_a_while(&spin);
+    for (; tail != h; tail ++) {
+      if (!ref_check(&ring[tail % RING_SIZE])) {
+        // stop here and let DUT report the mismatch
+        atomic_store_explicit(&ring_tail, tail, memory_order_release);
+        atomic_store_explicit(&ref_failed, true, memory_order_release);
+        return NULL;
+      }
+      if (tail % PUBLISH_INTERVAL == 0) atomic_store_explicit(&ring_tail, tail, memory_order_release);
+    }
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+  }
+}
+
+// Report the mismatch found by the REF thread as comparing after every
+// instruction. DUT is ahead of REF by the instructions still in the ring.
+static void report_failure() {
+  if (nemu_state.state == NEMU_ABORT) return;
+  uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+  InstRecord *r = &ring[tail % RING_SIZE];
+  Log("difftest: DUT has run %" PRIu64 " instructions ahead of the mismatch", head - tail - 1);
+  memcpy(&cpu, r->regs, DIFFTEST_REG_SIZE);
+  IFDEF(CONFIG_DIFFTEST_HISTORY, history_rewind(r->nr_hist));
+  checkregs(&fail_ref, r->pc);
+  if (fail_store >= 0) {
+    StoreRecord *st = &r->store[fail_store];
+    word_t ref = 0;
+    ref_difftest_memcpy(st->addr, &ref, st->len, DIFFTEST_TO_DUT);
+    Log("memory at " FMT_PADDR " is different after executing instruction at pc = " FMT_WORD
+        ", right = " FMT_WORD ", wrong = " FMT_WORD, st->addr, r->pc, ref, st->data);
+    if (nemu_state.state != NEMU_ABORT) abort_difftest(r->pc, &fail_ref);
+  }
+}
+
+// Wait until the REF thread has verified all records before `until`.
+// Return false if it finds a mismatch.
+static bool wait_ref(uint64_t until) {
+  int spin = 0;
+  atomic_store_explicit(&ring_head, head, memory_order_release);
+  while ((tail_seen = atomic_load_explicit(&ring_tail, memory_order_acquire)) < until) {
+    if (atomic_load_explicit(&ref_failed, memory_order_acquire)) { report_failure(); return false; }
+    wait_a_while(&spin);
+  }
+  return true;
+}
+
+static void push(vaddr_t pc) {
+  if (head - tail_seen == RING_SIZE && !wait_ref(head - RING_SIZE + 1)) return;
+  InstRecord *r = &ring[head % RING_SIZE];
+  r->pc = pc;
+  r->nr_store = nr_cur_store;
+  memcpy(r->store, cur_store, sizeof(cur_store[0]) * nr_cur_store);
+  memcpy(r->regs, &cpu, DIFFTEST_REG_SIZE);
+  IFDEF(CONFIG_DIFFTEST_HISTORY, r->nr_hist = nr_hist);
+  nr_cur_store = 0;
+  head ++;
+  if (head % PUBLISH_INTERVAL == 0) {
+    atomic_store_explicit(&ring_head, head, memory_order_release);
+    if (atomic_load_explicit(&ref_failed, memory_order_relaxed)) wait_ref(head);
+  }
+}
+
+// Wait until REF catches up with DUT. After that, DUT can access REF directly.
+void difftest_flush() {
+  if (!wait_ref(head)) return;
+  nr_cur_store = 0;
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, if (nemu_state.state != NEMU_ABORT) memhash_step(cpu.pc, head - nr_inst_synced));
+  nr_inst_synced = head;
+}
+
+static void init_ref_thread() {
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, ref_thread, NULL);
+  Assert(ret == 0, "can not create the thread of REF");
+  pthread_detach(thread);
+}
+#endif
 
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
+  // Check the instructions before the current one, since the device
+  // may copy data to REF.
+  IFDEF(CONFIG_DIFFTEST_BATCH, if (skip_dut_nr_inst == 0) batch_check(&last));
+  IFDEF(CONFIG_DIFFTEST_THREAD, difftest_flush());
   is_skip_ref = true;
   // If such an instruction is one of the instruction packing in QEMU
   // (see below), we end the process of catching up with QEMU's pc to
@@ -52,6 +672,8 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  IFDEF(CONFIG_DIFFTEST_BATCH, if (skip_dut_nr_inst == 0) batch_check(&last));
+  IFDEF(CONFIG_DIFFTEST_THREAD, difftest_flush());
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -78,35 +700,61 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   ref_difftest_raise_intr = dlsym(handle, "difftest_raise_intr");
   assert(ref_difftest_raise_intr);
 
+  // optional, the dirty pages are copied from REF and hashed if it is missing
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, ref_difftest_memhash = dlsym(handle, "difftest_memhash"));
+  IFDEF(CONFIG_DIFFTEST_BATCH, ref_difftest_exec_to = dlsym(handle, "difftest_exec_to"));
+
   void (*ref_difftest_init)(int) = dlsym(handle, "difftest_init");
   assert(ref_difftest_init);
 
   Log("Differential testing: %s", ANSI_FMT("ON", ANSI_FG_GREEN));
+#ifdef CONFIG_DIFFTEST_BATCH
+  Log("The result will be compared with %s at the end of each %s. "
+      "The first mismatched instruction will be found by replaying the batch.",
+      ref_so_file, MUXDEF(CONFIG_DIFFTEST_PER_BLOCK, "basic block", "batch"));
+#elif defined(CONFIG_DIFFTEST_THREAD)
+  Log("The result of every instruction will be compared with %s, "
+      "which runs on a separate thread.", ref_so_file);
+#else
   Log("The result of every instruction will be compared with %s. "
       "This will help you a lot for debugging, but also significantly reduce the performance. "
       "If it is not necessary, you can turn it off in menuconfig.", ref_so_file);
+#endif
+  IFDEF(CONFIG_DIFFTEST_BATCH, if (ref_difftest_exec_to != NULL)
+      Log("The reference design runs each batch natively until reaching the end of it."));
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, Log("The pages written will also be compared every %d instructions.",
+        CONFIG_DIFFTEST_MEMHASH_INTERVAL));
 
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
+  IFDEF(CONFIG_DIFFTEST_THREAD, init_ref_thread());
+}
+
+// Stop at the mismatch found after executing the instruction at `pc`.
+static void abort_difftest(vaddr_t pc, CPU_state *ref) {
+  mismatched = true;
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  MUXDEF(CONFIG_DIFFTEST_HISTORY, history_report(pc, ref), isa_reg_display());
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
-  if (!isa_difftest_checkregs(ref, pc)) {
-    nemu_state.state = NEMU_ABORT;
-    nemu_state.halt_pc = pc;
-    isa_reg_display();
-  }
+  if (!isa_difftest_checkregs(ref, pc)) abort_difftest(pc, ref);
 }
 
 void difftest_step(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
   if (skip_dut_nr_inst > 0) {
+    // the stores of the skipped instructions are not checked
+    IFDEF(CONFIG_DIFFTEST_THREAD, nr_cur_store = 0);
     ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
     if (ref_r.pc == npc) {
       skip_dut_nr_inst = 0;
       checkregs(&ref_r, npc);
+      IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
       return;
     }
     skip_dut_nr_inst --;
@@ -119,13 +767,28 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
     // to skip the checking of an instruction, just copy the reg state to reference design
     ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
     is_skip_ref = false;
+    IFDEF(CONFIG_DIFFTEST_BATCH, checkpoint());
+    IFDEF(CONFIG_DIFFTEST_THREAD, nr_cur_store = 0);
     return;
   }
 
+#ifdef CONFIG_DIFFTEST_BATCH
+  batch_npc[nr_pending ++] = npc;
+  if (nr_pending >= BATCH_SIZE || nr_undo > NR_UNDO - 16) difftest_flush();
+  else last = cpu;
+  return;
+#endif
+
+#ifdef CONFIG_DIFFTEST_THREAD
+  push(pc);
+  return;
+#endif
+
   ref_difftest_exec(1);
   ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
 
   checkregs(&ref_r, pc);
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, if (nemu_state.state != NEMU_ABORT) memhash_step(pc, 1));
 }
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
@@ -0,0 +1,346 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/replay.h>
+#include <memory/paddr.h>
+#include <difftest-def.h>
+#include <signal.h>
+
+#ifdef CONFIG_REPLAY
+
+// The execution log is a stream of records. A record begins with a tag,
+// whose top two bits are the kind of the record, and the numbers after
+// the tag are LEB128 varints. The registers are the ones copied by
+// difftest except pc, which is the last of them.
+//   INST: bit 5 of the tag is set if dnpc != snpc, and the other bits are
+//         the number of registers changed, or 31 if the number follows.
+//         Then zigzag(dnpc - snpc) if bit 5 is set, and the index and
+//         zigzag(new - old) of each register changed.
+//   READ: the other bits of the tag are the length of a device read.
+//         Then zigzag(addr - addr of the last read), and the data.
+//   INTR: the interrupt taken after the last instruction.
+//   The other bits of the tag of the last kind are one of these:
+//   END:  the end of the execution.
+//   DMA:  the bytes written to the memory by a device. Then the address,
+//         the length, and the bytes.
+// The log begins with the magic, the number of registers, and the values
+// of the registers and pc at the beginning.
+#define NR_REG (DIFFTEST_REG_SIZE / sizeof(word_t) - 1)
+#define BUF_SIZE (64 * 1024)
+#define TAG(kind, x) (((kind) << 6) | (x))
+
+enum { REC_INST, REC_READ, REC_INTR, REC_OTHER };
+enum { OTHER_END, OTHER_DMA };
+#define TAG_END TAG(REC_OTHER, OTHER_END)
+#define TAG_DMA TAG(REC_OTHER, OTHER_DMA)
+
+static const char magic[8] = "NEMURPL1";
+static const char *rec_name[] = { "an instruction", "a device read", "an interrupt", "the end", "a DMA write" };
+
+int g_replay_mode = REPLAY_OFF;
+bool g_replay_intr = false;
+
+static FILE *fp = NULL;
+static const char *log_file = NULL;
+// The log is streamed through this buffer, so only this part of it is in memory.
+static uint8_t buf[BUF_SIZE];
+static int buf_pos = 0, buf_len = 0;
+static word_t last_regs[NR_REG];
+static paddr_t last_addr = 0;
+static uint64_t nr_inst = 0;
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static void put_byte(uint8_t b) {
+  if (buf_pos == BUF_SIZE) {
+    size_t ret = fwrite(buf, 1, BUF_SIZE, fp);
+    Assert(ret == BUF_SIZE, "can not write the execution log %s", log_file);
+    buf_pos = 0;
+  }
+  buf[buf_pos ++] = b;
+}
+
+static void put_num(uint64_t v) {
+  for (; v >= 0x80; v >>= 7) put_byte(v | 0x80);
+  put_byte(v);
+}
+
+// Return -1 at the end of the log.
+static int get_byte() {
+  if (buf_pos == buf_len) {
+    buf_len = fread(buf, 1, BUF_SIZE, fp);
+    buf_pos = 0;
+    if (buf_len == 0) return -1;
+  }
+  return buf[buf_pos ++];
+}
+
+static int peek_byte() {
+  int b = get_byte();
+  if (b >= 0) buf_pos --;
+  return b;
+}
+
+static uint64_t get_num() {
+  uint64_t v = 0;
+  int shift, b;
+  for (shift = 0; ; shift += 7) {
+    b = get_byte();
+    Assert(b >= 0, "the execution log %s is truncated", log_file);
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return v;
+  }
+}
+
+static const char* tag_name(int tag) {
+  return (tag < 0 ? "nothing" : rec_name[(tag >> 6) + (tag == TAG_DMA)]);
+}
+
+// Write the bytes of the DMA records at the current point of the log to
+// the memory. They are written by the devices at this point when recording.
+static void apply_dma() {
+  while (peek_byte() == TAG_DMA) {
+    get_byte();
+    paddr_t addr = get_num();
+    uint32_t len = get_num(), i;
+    Assert(in_pmem(addr) && in_pmem(addr + len - 1), "the execution log %s is corrupted", log_file);
+    uint8_t *p = guest_to_host(addr);
+    for (i = 0; i < len; i ++) {
+      int b = get_byte();
+      Assert(b >= 0, "the execution log %s is truncated", log_file);
+      p[i] = b;
+    }
+  }
+}
+
+// Stop checking, and let the reads go to the devices again.
+static void mismatch(vaddr_t pc) {
+  g_replay_mode = REPLAY_OFF;
+  g_replay_intr = false;
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = pc;
+  isa_reg_display();
+}
+
+static void record_inst(Decode *s) {
+  word_t *regs = (word_t *)&cpu;
+  uint8_t changed[NR_REG];
+  int n = 0, i;
+  for (i = 0; i < NR_REG; i ++) {
+    if (regs[i] != last_regs[i]) changed[n ++] = i;
+  }
+  bool jump = (s->dnpc != s->snpc);
+  put_byte(TAG(REC_INST, (jump << 5) | (n < 31 ? n : 31)));
+  if (n >= 31) put_num(n);
+  if (jump) put_num(zigzag((sword_t)(s->dnpc - s->snpc)));
+  for (i = 0; i < n; i ++) {
+    int idx = changed[i];
+    put_byte(idx);
+    put_num(zigzag((sword_t)(regs[idx] - last_regs[idx])));
+    last_regs[idx] = regs[idx];
+  }
+}
+
+static void check_inst(Decode *s) {
+  int tag = get_byte();
+  if (tag < 0 || (tag >> 6) != REC_INST) {
+    Log("replay: the log has %s at instruction %" PRIu64 ", but DUT executes the instruction at pc = " FMT_WORD,
+        tag_name(tag), nr_inst, s->pc);
+    mismatch(s->pc);
+    return;
+  }
+  int n = tag & 31, i;
+  if (n == 31) n = get_num();
+  vaddr_t dnpc = s->snpc;
+  if (tag & 0x20) dnpc += unzigzag(get_num());
+  for (i = 0; i < n; i ++) {
+    int idx = get_byte();
+    Assert(idx >= 0 && idx < NR_REG, "the execution log %s is corrupted", log_file);
+    last_regs[idx] += unzigzag(get_num());
+  }
+
+  if (dnpc != s->dnpc) {
+    Log("replay: pc is different after executing instruction %" PRIu64 " at pc = " FMT_WORD
+        ", right = " FMT_WORD ", wrong = " FMT_WORD, nr_inst, s->pc, dnpc, s->dnpc);
+    mismatch(s->pc);
+    return;
+  }
+  word_t *regs = (word_t *)&cpu;
+  bool ok = true;
+  for (i = 0; i < NR_REG; i ++) {
+    if (regs[i] != last_regs[i]) {
+      Log("replay: %s is different after executing instruction %" PRIu64 " at pc = " FMT_WORD
+          ", right = " FMT_WORD ", wrong = " FMT_WORD,
+          isa_difftest_reg_name(i), nr_inst, s->pc, last_regs[i], regs[i]);
+      ok = false;
+    }
+  }
+  if (!ok) { mismatch(s->pc); return; }
+  apply_dma();
+  g_replay_intr = (peek_byte() >> 6 == REC_INTR);
+}
+
+void replay_step(Decode *s) {
+  if (g_replay_mode == REPLAY_RECORD) record_inst(s);
+  else check_inst(s);
+  nr_inst ++;
+}
+
+void replay_record_read(paddr_t addr, int len, word_t data) {
+  put_byte(TAG(REC_READ, len));
+  put_num(zigzag((int64_t)addr - (int64_t)last_addr));
+  put_num(data);
+  last_addr = addr;
+}
+
+// Return the data of the device read from the log.
+word_t replay_read(paddr_t addr, int len) {
+  int tag = get_byte();
+  if (tag < 0 || (tag >> 6) != REC_READ) {
+    Log("replay: the log has %s at instruction %" PRIu64 ", but DUT reads %d bytes at " FMT_PADDR
+        " at pc = " FMT_WORD, tag_name(tag), nr_inst, len, addr, cpu.pc);
+    mismatch(cpu.pc);
+    return 0;
+  }
+  paddr_t rec_addr = last_addr + unzigzag(get_num());
+  word_t data = get_num();
+  last_addr = rec_addr;
+  if (rec_addr != addr || (tag & 0x3f) != len) {
+    Log("replay: DUT reads %d bytes at " FMT_PADDR ", but the log reads %d bytes at " FMT_PADDR
+        " at pc = " FMT_WORD, len, addr, tag & 0x3f, rec_addr, cpu.pc);
+    mismatch(cpu.pc);
+  }
+  apply_dma();
+  return data;
+}
+
+// Query the interrupt to take after the current instruction. When checking,
+// the interrupts raised by devices are ignored, and the ones in the log are
+// taken at the same points.
+word_t replay_query_intr() {
+  word_t intr;
+  switch (g_replay_mode) {
+    case REPLAY_CHECK:
+      if (!g_replay_intr) return INTR_EMPTY;
+      g_replay_intr = false;
+      get_byte();
+      intr = get_num();
+      apply_dma();
+      return intr;
+    case REPLAY_RECORD:
+      intr = isa_query_intr();
+      if (intr != INTR_EMPTY) {
+        put_byte(TAG(REC_INTR, 0));
+        put_num(intr);
+      }
+      return intr;
+    default: return isa_query_intr();
+  }
+}
+
+void replay_record_dma(paddr_t addr, uint32_t len) {
+  if (g_replay_mode != REPLAY_RECORD || len == 0) return;
+  uint8_t *p = guest_to_host(addr);
+  uint32_t i;
+  put_byte(TAG_DMA);
+  put_num(addr);
+  put_num(len);
+  for (i = 0; i < len; i ++) put_byte(p[i]);
+}
+
+// Called when DUT ends, so that a mismatch is reported before the trap.
+void replay_check_end() {
+  if (g_replay_mode != REPLAY_CHECK) return;
+  int tag = peek_byte();
+  if (tag != TAG_END) {
+    Log("replay: DUT ends at instruction %" PRIu64 ", but the log has %s", nr_inst, tag_name(tag));
+    mismatch(nemu_state.halt_pc);
+  }
+}
+
+// Write the rest of the log. It is called at exit, and also when NEMU
+// aborts, since atexit() handlers do not run then.
+void replay_finish() {
+  if (fp == NULL) return;
+  int mode = g_replay_mode;
+  // the Asserts below call this again
+  g_replay_mode = REPLAY_OFF;
+  if (mode == REPLAY_RECORD) put_byte(TAG_END);
+  FILE *f = fp;
+  fp = NULL;
+  if (mode == REPLAY_RECORD) {
+    size_t ret = fwrite(buf, 1, buf_pos, f);
+    Assert(ret == buf_pos, "can not write the execution log %s", log_file);
+    Log("Execution log: %" PRIu64 " instructions are recorded to %s in %ld bytes", nr_inst, log_file, ftell(f));
+  } else if (mode == REPLAY_CHECK) {
+    Log("Execution log: %" PRIu64 " instructions are checked against %s", nr_inst, log_file);
+  }
+  fclose(f);
+}
+
+// Stop the execution as closing the window does, so that the log is finished.
+// Press Ctrl-C again to kill NEMU.
+static void sigint_handler(int sig) {
+  nemu_state.state = NEMU_QUIT;
+}
+
+void init_replay(const char *record_file, const char *replay_file) {
+  if (record_file == NULL && replay_file == NULL) return;
+  Assert(record_file == NULL || replay_file == NULL, "can not record and replay the execution log at the same time");
+
+  word_t *regs = (word_t *)&cpu;
+  int i;
+  memcpy(last_regs, regs, sizeof(last_regs));
+  if (record_file != NULL) {
+    log_file = record_file;
+    fp = fopen(log_file, "wb");
+    Assert(fp, "Can not open '%s'", log_file);
+    for (i = 0; i < sizeof(magic); i ++) put_byte(magic[i]);
+    put_num(NR_REG);
+    for (i = 0; i <= NR_REG; i ++) put_num(regs[i]);
+    g_replay_mode = REPLAY_RECORD;
+    struct sigaction sa = { .sa_handler = sigint_handler, .sa_flags = SA_RESETHAND };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    atexit(replay_finish);
+    Log("Execution log: %s, the execution is recorded to it", log_file);
+    return;
+  }
+
+  log_file = replay_file;
+  fp = fopen(log_file, "rb");
+  Assert(fp, "Can not open '%s'", log_file);
+  for (i = 0; i < sizeof(magic); i ++) {
+    Assert(get_byte() == (uint8_t)magic[i], "%s is not an execution log", log_file);
+  }
+  Assert(get_num() == NR_REG, "the execution log %s is recorded for another ISA", log_file);
+  for (i = 0; i <= NR_REG; i ++) {
+    word_t r = get_num();
+    Assert(r == regs[i], "%s is different at the beginning of the execution log %s, right = "
+        FMT_WORD ", wrong = " FMT_WORD, isa_difftest_reg_name(i), log_file, r, regs[i]);
+  }
+  g_replay_mode = REPLAY_CHECK;
+  atexit(replay_finish);
+  apply_dma();
+  g_replay_intr = (peek_byte() >> 6 == REC_INTR);
+  Log("Execution log: %s, the execution is checked against it, "
+      "and the values read from devices and the DMA writes are taken from it", log_file);
+}
+#else
+void init_replay(const char *record_file, const char *replay_file) { }
+#endif
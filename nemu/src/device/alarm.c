@@ -15,37 +15,69 @@
 
 #include <common.h>
 #include <device/alarm.h>
-#include <sys/time.h>
-#include <signal.h>
+#include <device/event.h>
+#include <pthread.h>
+#include <time.h>
 
-#define MAX_HANDLER 8
+void add_alarm_handle(alarm_handler_t h) {
+  event_add("alarm", EVENT_HOST, 1000000 / TIMER_HZ, 1000000 / TIMER_HZ, h);
+}
 
-static alarm_handler_t handler[MAX_HANDLER] = {};
-static int idx = 0;
+#ifdef CONFIG_ALARM_VIRTUAL
+// The host time is derived from the number of guest instructions,
+// so all host events are scheduled by the CPU loop itself.
+void init_alarm() {
+  Log("Alarm runs in virtual time, %d guest instructions per %d Hz tick",
+      CONFIG_ALARM_VIRTUAL_INTERVAL, TIMER_HZ);
+}
+#else
+// The timer thread sleeps until the earliest host event is due, then kicks
+// the CPU loop to run event_update(). The handlers themselves always run in
+// the CPU thread, so they need no locking.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static uint64_t deadline = UINT64_MAX;
 
-void add_alarm_handle(alarm_handler_t h) {
-  assert(idx < MAX_HANDLER);
-  handler[idx ++] = h;
+void alarm_set(uint64_t us) {
+  pthread_mutex_lock(&lock);
+  bool earlier = (us < deadline);
+  deadline = us;
+  if (earlier) pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
 }
 
-static void alarm_sig_handler(int signum) {
-  int i;
-  for (i = 0; i < idx; i ++) {
-    handler[i]();
+static void* alarm_thread(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (true) {
+    uint64_t now = get_time();
+    if (deadline <= now) {
+      deadline = UINT64_MAX;
+      event_kick();
+    } else if (deadline == UINT64_MAX) {
+      pthread_cond_wait(&cond, &lock);
+    } else {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      uint64_t ns = ts.tv_nsec + (deadline - now) * 1000;
+      ts.tv_sec += ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait(&cond, &lock, &ts);
+    }
   }
+  return NULL;
 }
 
 void init_alarm() {
-  struct sigaction s;
-  memset(&s, 0, sizeof(s));
-  s.sa_handler = alarm_sig_handler;
-  int ret = sigaction(SIGVTALRM, &s, NULL);
-  Assert(ret == 0, "Can not set signal handler");
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &attr);
+  pthread_condattr_destroy(&attr);
 
-  struct itimerval it = {};
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
-  it.it_interval = it.it_value;
-  ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
-  Assert(ret == 0, "Can not set timer");
+  get_time(); // initialize the boot time before the timer thread uses it
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, alarm_thread, NULL);
+  Assert(ret == 0, "Can not create alarm thread");
+  pthread_detach(thread);
 }
+#endif
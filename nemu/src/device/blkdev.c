@@ -0,0 +1,396 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/blkdev.h>
+#include <device/event.h>
+#include <cpu/replay.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef CONFIG_BLKDEV_ASYNC
+#include <pthread.h>
+#endif
+
+#define CACHE_BLK_SIZE 4096
+#define NR_CACHE_BLK CONFIG_BLKDEV_CACHE_SIZE
+#define NR_REQ 16
+#define MAX_BLKDEV 4
+
+enum { REQ_READ, REQ_WRITE, REQ_FLUSH };
+
+typedef struct {
+  int type;
+  uint64_t offset;
+  uint32_t len;
+  void *buf;
+  blkdev_callback_t done;
+  void *arg;
+} BlkReq;
+
+typedef struct CacheBlk {
+  uint64_t no; // block number in the image, UINT64_MAX if the block is free
+  bool dirty;
+  struct CacheBlk *prev, *next; // in the LRU list, the most recent one first
+  struct CacheBlk *hnext;       // in the hash chain
+  uint8_t *data;
+} CacheBlk;
+
+struct BlkDev {
+  const char *name;
+  int fd; // the image, or the delta file with an overlay
+  uint64_t size;
+  // With an overlay, the base image is mapped read-only, and `bitmap`
+  // tells the blocks which are written to the delta file.
+  uint8_t *base;
+  uint64_t *bitmap;
+
+  // The cache is only accessed by the I/O thread, or by the CPU thread when
+  // there is no pending request, so it is not protected by the lock.
+  CacheBlk blk[NR_CACHE_BLK];
+  CacheBlk *hash[NR_CACHE_BLK];
+  CacheBlk lru; // sentinel of the LRU list
+  uint64_t nr_hit, nr_miss, nr_writeback;
+
+#ifdef CONFIG_BLKDEV_ASYNC
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond_req, cond_idle;
+  BlkReq req[NR_REQ];  // submitted requests
+  BlkReq done[NR_REQ]; // completed requests whose callbacks are not called yet
+  int req_head, req_tail, done_head, done_tail;
+  int nr_pending; // number of submitted requests which are not completed
+  bool exit;
+#endif
+};
+
+static BlkDev *devs[MAX_BLKDEV] = {};
+static int nr_dev = 0;
+
+/* cache */
+
+static inline int hash_idx(uint64_t no) {
+  return (no * 0x9e3779b97f4a7c15ull) % NR_CACHE_BLK;
+}
+
+static void lru_remove(CacheBlk *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push_front(BlkDev *dev, CacheBlk *b) {
+  b->next = dev->lru.next;
+  b->prev = &dev->lru;
+  dev->lru.next->prev = b;
+  dev->lru.next = b;
+}
+
+static void hash_remove(BlkDev *dev, CacheBlk *b) {
+  CacheBlk **p = &dev->hash[hash_idx(b->no)];
+  while (*p != b) p = &(*p)->hnext;
+  *p = b->hnext;
+}
+
+static void blk_writeback(BlkDev *dev, CacheBlk *b) {
+  uint64_t offset = b->no * CACHE_BLK_SIZE;
+  uint64_t len = dev->size - offset;
+  if (len > CACHE_BLK_SIZE) len = CACHE_BLK_SIZE;
+  ssize_t ret = pwrite(dev->fd, b->data, len, offset);
+  Assert(ret == (ssize_t)len, "%s: write back failed at offset %" PRIu64, dev->name, offset);
+  if (dev->bitmap != NULL) dev->bitmap[b->no / 64] |= 1ull << (b->no % 64);
+  b->dirty = false;
+  dev->nr_writeback ++;
+}
+
+// Return the cached block `no`. The block is read from the image on a
+// miss if `fill` is true, since it is not needed when the whole block is
+// to be overwritten.
+static CacheBlk* cache_get(BlkDev *dev, uint64_t no, bool fill) {
+  CacheBlk *b;
+  for (b = dev->hash[hash_idx(no)]; b != NULL; b = b->hnext) {
+    if (b->no == no) {
+      dev->nr_hit ++;
+      lru_remove(b);
+      lru_push_front(dev, b);
+      return b;
+    }
+  }
+
+  dev->nr_miss ++;
+  b = dev->lru.prev; // evict the least recently used one
+  if (b->no != UINT64_MAX) {
+    if (b->dirty) blk_writeback(dev, b);
+    hash_remove(dev, b);
+  }
+  b->no = no;
+  b->hnext = dev->hash[hash_idx(no)];
+  dev->hash[hash_idx(no)] = b;
+  lru_remove(b);
+  lru_push_front(dev, b);
+
+  if (fill) {
+    uint64_t offset = no * CACHE_BLK_SIZE;
+    ssize_t ret;
+    if (dev->bitmap != NULL && !(dev->bitmap[no / 64] & (1ull << (no % 64)))) {
+      // not written yet, read it from the base image
+      ret = (dev->size - offset < CACHE_BLK_SIZE ? dev->size - offset : CACHE_BLK_SIZE);
+      memcpy(b->data, dev->base + offset, ret);
+    } else {
+      ret = pread(dev->fd, b->data, CACHE_BLK_SIZE, offset);
+      Assert(ret >= 0, "%s: read failed at offset %" PRIu64, dev->name, offset);
+    }
+    // the last block may be partial
+    memset(b->data + ret, 0, CACHE_BLK_SIZE - ret);
+  }
+  return b;
+}
+
+static void cache_rw(BlkDev *dev, bool is_write, uint64_t offset, uint32_t len, uint8_t *buf) {
+  Assert(offset + len <= dev->size, "%s: access [%" PRIu64 ", %" PRIu64 ") is out of bound of the image",
+      dev->name, offset, offset + len);
+  while (len > 0) {
+    uint64_t no = offset / CACHE_BLK_SIZE;
+    uint32_t blk_off = offset % CACHE_BLK_SIZE;
+    uint32_t n = CACHE_BLK_SIZE - blk_off;
+    if (n > len) n = len;
+    CacheBlk *b = cache_get(dev, no, !(is_write && n == CACHE_BLK_SIZE));
+    if (is_write) { memcpy(b->data + blk_off, buf, n); b->dirty = true; }
+    else memcpy(buf, b->data + blk_off, n);
+    offset += n; buf += n; len -= n;
+  }
+}
+
+static void cache_flush(BlkDev *dev) {
+  int i;
+  bool written = false;
+  for (i = 0; i < NR_CACHE_BLK; i ++) {
+    if (dev->blk[i].dirty) { blk_writeback(dev, &dev->blk[i]); written = true; }
+  }
+  // the delta file is discarded at exit, so there is no need to sync it
+  if (written && dev->bitmap == NULL) fdatasync(dev->fd);
+}
+
+static void serve(BlkDev *dev, BlkReq *r) {
+  if (r->type == REQ_FLUSH) cache_flush(dev);
+  else cache_rw(dev, r->type == REQ_WRITE, r->offset, r->len, r->buf);
+}
+
+/* requests */
+
+#ifdef CONFIG_BLKDEV_ASYNC
+static void* io_thread(void *arg) {
+  BlkDev *dev = arg;
+  pthread_mutex_lock(&dev->lock);
+  while (true) {
+    while (dev->req_head == dev->req_tail && !dev->exit) pthread_cond_wait(&dev->cond_req, &dev->lock);
+    if (dev->req_head == dev->req_tail) break;
+    BlkReq r = dev->req[dev->req_head];
+    pthread_mutex_unlock(&dev->lock);
+
+    serve(dev, &r);
+
+    pthread_mutex_lock(&dev->lock);
+    dev->req_head = (dev->req_head + 1) % NR_REQ;
+    dev->nr_pending --;
+    if (r.done != NULL) {
+      dev->done[dev->done_tail] = r;
+      dev->done_tail = (dev->done_tail + 1) % NR_REQ;
+      event_kick();
+    }
+    if (dev->nr_pending == 0) pthread_cond_broadcast(&dev->cond_idle);
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return NULL;
+}
+
+static void wait_idle(BlkDev *dev) {
+  pthread_mutex_lock(&dev->lock);
+  while (dev->nr_pending > 0) pthread_cond_wait(&dev->cond_idle, &dev->lock);
+  pthread_mutex_unlock(&dev->lock);
+}
+#endif
+
+#ifdef CONFIG_BLKDEV_ASYNC
+// Call the callbacks of the completed requests in the CPU thread.
+static void call_done(BlkDev *dev) {
+  while (true) {
+    pthread_mutex_lock(&dev->lock);
+    bool empty = (dev->done_head == dev->done_tail);
+    BlkReq r = dev->done[dev->done_head];
+    if (!empty) dev->done_head = (dev->done_head + 1) % NR_REQ;
+    pthread_mutex_unlock(&dev->lock);
+    if (empty) break;
+    r.done(r.arg);
+  }
+}
+#endif
+
+static void submit(BlkDev *dev, BlkReq *r) {
+#ifdef CONFIG_BLKDEV_ASYNC
+#ifdef CONFIG_REPLAY
+  // When checking against the execution log, the data read is written to the
+  // memory from the log, so the I/O thread should not write it afterwards.
+  if (replay_dma_from_log()) {
+    wait_idle(dev);
+    call_done(dev);
+    serve(dev, r);
+    if (r->done != NULL) r->done(r->arg);
+    return;
+  }
+#endif
+  pthread_mutex_lock(&dev->lock);
+  while (true) {
+    // the completed requests also take the slots until their callbacks are called
+    int nr_done = (dev->done_tail - dev->done_head + NR_REQ) % NR_REQ;
+    if (dev->nr_pending + nr_done < NR_REQ - 1) break;
+    // Too many requests in flight, wait for the I/O thread. If it is idle,
+    // the slots are freed by calling the callbacks here.
+    if (dev->nr_pending > 0) { pthread_cond_wait(&dev->cond_idle, &dev->lock); continue; }
+    pthread_mutex_unlock(&dev->lock);
+    call_done(dev);
+    pthread_mutex_lock(&dev->lock);
+  }
+  dev->req[dev->req_tail] = *r;
+  dev->req_tail = (dev->req_tail + 1) % NR_REQ;
+  dev->nr_pending ++;
+  pthread_cond_signal(&dev->cond_req);
+  pthread_mutex_unlock(&dev->lock);
+#else
+  serve(dev, r);
+  if (r->done != NULL) r->done(r->arg);
+#endif
+}
+
+void blkdev_submit(BlkDev *dev, bool is_write, uint64_t offset, uint32_t len,
+    void *buf, blkdev_callback_t done, void *arg) {
+  BlkReq r = { .type = (is_write ? REQ_WRITE : REQ_READ), .offset = offset, .len = len,
+    .buf = buf, .done = done, .arg = arg };
+  submit(dev, &r);
+}
+
+void blkdev_flush(BlkDev *dev, blkdev_callback_t done, void *arg) {
+  BlkReq r = { .type = REQ_FLUSH, .done = done, .arg = arg };
+  submit(dev, &r);
+}
+
+void blkdev_rw(BlkDev *dev, bool is_write, uint64_t offset, uint32_t len, void *buf) {
+  IFDEF(CONFIG_BLKDEV_ASYNC, wait_idle(dev));
+  cache_rw(dev, is_write, offset, len, buf);
+}
+
+void blkdev_update() {
+#ifdef CONFIG_BLKDEV_ASYNC
+  int i;
+  for (i = 0; i < nr_dev; i ++) call_done(devs[i]);
+#endif
+}
+
+uint64_t blkdev_size(BlkDev *dev) {
+  return dev->size;
+}
+
+void blkdev_statistic() {
+  int i;
+  for (i = 0; i < nr_dev; i ++) {
+    BlkDev *dev = devs[i];
+    Log("%s cache hit = %" PRIu64 ", miss = %" PRIu64 ", write back = %" PRIu64 " blocks",
+        dev->name, dev->nr_hit, dev->nr_miss, dev->nr_writeback);
+  }
+}
+
+void blkdev_exit() {
+  int i;
+  for (i = 0; i < nr_dev; i ++) {
+    BlkDev *dev = devs[i];
+#ifdef CONFIG_BLKDEV_ASYNC
+    // an assertion may fail in the I/O thread itself
+    if (!pthread_equal(pthread_self(), dev->thread)) {
+      pthread_mutex_lock(&dev->lock);
+      dev->exit = true;
+      pthread_cond_signal(&dev->cond_req);
+      pthread_mutex_unlock(&dev->lock);
+      pthread_join(dev->thread, NULL);
+    }
+#endif
+    cache_flush(dev);
+    close(dev->fd);
+  }
+  nr_dev = 0;
+}
+
+#ifdef CONFIG_BLKDEV_OVERLAY
+// Map the base image read-only, so that it is shared by all NEMU instances
+// in the page cache, and create a sparse delta file of the same size for the
+// written blocks. The delta file is unlinked at once, and it is gone with
+// this instance.
+static void init_overlay(BlkDev *dev, int base_fd) {
+  if (dev->size > 0) {
+    dev->base = mmap(NULL, dev->size, PROT_READ, MAP_SHARED, base_fd, 0);
+    Assert(dev->base != MAP_FAILED, "Can not mmap %s image", dev->name);
+  }
+  close(base_fd);
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/nemu-%s-XXXXXX", CONFIG_BLKDEV_OVERLAY_DIR, dev->name);
+  dev->fd = mkstemp(path);
+  Assert(dev->fd >= 0, "Can not create the delta file %s", path);
+  unlink(path);
+  int ret = ftruncate(dev->fd, dev->size);
+  Assert(ret == 0, "Can not resize the delta file of %s", dev->name);
+
+  uint64_t nr_blk = (dev->size + CACHE_BLK_SIZE - 1) / CACHE_BLK_SIZE;
+  dev->bitmap = calloc((nr_blk + 63) / 64 + 1, sizeof(uint64_t));
+  assert(dev->bitmap);
+}
+#endif
+
+BlkDev* blkdev_open(const char *name, const char *path) {
+  assert(nr_dev < MAX_BLKDEV);
+  int fd = open(path, MUXDEF(CONFIG_BLKDEV_OVERLAY, O_RDONLY, O_RDWR));
+  if (fd < 0) return NULL;
+  struct stat st;
+  int ret = fstat(fd, &st);
+  Assert(ret == 0, "Can not stat %s image: %s", name, path);
+
+  BlkDev *dev = malloc(sizeof(BlkDev));
+  assert(dev);
+  memset(dev, 0, sizeof(*dev));
+  dev->name = name;
+  dev->fd = fd;
+  dev->size = st.st_size;
+  IFDEF(CONFIG_BLKDEV_OVERLAY, init_overlay(dev, fd));
+
+  uint8_t *data = malloc((size_t)NR_CACHE_BLK * CACHE_BLK_SIZE);
+  assert(data);
+  dev->lru.next = dev->lru.prev = &dev->lru;
+  int i;
+  for (i = 0; i < NR_CACHE_BLK; i ++) {
+    dev->blk[i].no = UINT64_MAX;
+    dev->blk[i].data = data + (size_t)i * CACHE_BLK_SIZE;
+    lru_push_front(dev, &dev->blk[i]);
+  }
+
+#ifdef CONFIG_BLKDEV_ASYNC
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_cond_init(&dev->cond_req, NULL);
+  pthread_cond_init(&dev->cond_idle, NULL);
+  ret = pthread_create(&dev->thread, NULL, io_thread, dev);
+  Assert(ret == 0, "Can not create the I/O thread of %s", name);
+#endif
+
+  if (nr_dev == 0) atexit(blkdev_exit);
+  devs[nr_dev ++] = dev;
+  return dev;
+}
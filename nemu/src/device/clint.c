@@ -0,0 +1,64 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/event.h>
+#include <device/intr.h>
+
+// https://github.com/riscv/riscv-aclint/blob/main/riscv-aclint.adoc
+// Only one hart is supported. mtime counts in microseconds of the host
+// time, which is derived from the guest instructions in virtual time.
+
+#define CLINT_MSIP     0x0000
+#define CLINT_MTIMECMP 0x4000
+#define CLINT_MTIME    0xbff8
+#define CLINT_SIZE     0x10000
+
+static uint8_t *clint_base = NULL;
+
+#define MSIP     (*(uint32_t *)(clint_base + CLINT_MSIP))
+#define MTIMECMP (*(uint64_t *)(clint_base + CLINT_MTIMECMP))
+#define MTIME    (*(uint64_t *)(clint_base + CLINT_MTIME))
+
+static void clint_timer_update() {
+  uint64_t now = event_host_time();
+  intr_set_line(INTR_LINE_TIMER, now >= MTIMECMP);
+}
+
+static void clint_io_handler(uint32_t offset, int len, bool is_write) {
+  if (offset >= CLINT_MTIME && offset < CLINT_MTIME + 8) {
+    // mtime is read-only
+    MTIME = event_host_time();
+  } else if (offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8) {
+    if (!is_write) return;
+    // only one event is needed for the latest mtimecmp
+    event_cancel(clint_timer_update);
+    uint64_t now = event_host_time();
+    if (now < MTIMECMP) event_add("mtimecmp", EVENT_HOST, MTIMECMP - now, 0, clint_timer_update);
+    clint_timer_update();
+  } else if (offset < CLINT_MSIP + 4) {
+    if (is_write) {
+      MSIP &= 1;
+      intr_set_line(INTR_LINE_SOFT, MSIP);
+    }
+  }
+}
+
+void init_clint() {
+  clint_base = new_space(CLINT_SIZE);
+  memset(clint_base, 0, CLINT_SIZE);
+  MTIMECMP = UINT64_MAX;
+  add_mmio_map("clint", CONFIG_CLINT_MMIO, clint_base, CLINT_SIZE, clint_io_handler);
+}
@@ -16,11 +16,16 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
-#ifndef CONFIG_TARGET_AM
+#include <device/event.h>
+#include <device/blkdev.h>
+#include <device/map.h>
+#ifdef CONFIG_HAS_SDL
 #include <SDL2/SDL.h>
 #endif
 
 void init_map();
+void init_clint();
+void init_plic();
 void init_serial();
 void init_timer();
 void init_vga();
@@ -28,29 +33,27 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
+void init_net();
+void init_virtio_blk();
+void init_virtio_console();
 void init_alarm();
 
 void send_key(uint8_t, bool);
-void vga_update_screen();
 
 void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
-
-  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
+  IFDEF(CONFIG_BLKDEV, blkdev_update());
+  event_update();
+}
 
-#ifndef CONFIG_TARGET_AM
+#ifdef CONFIG_HAS_SDL
+static void sdl_poll_event() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
       case SDL_QUIT:
         nemu_state.state = NEMU_QUIT;
         break;
-#ifdef CONFIG_HAS_KEYBOARD
+#ifdef CONFIG_KEYBOARD_SDL
       // If a key was pressed
       case SDL_KEYDOWN:
       case SDL_KEYUP: {
@@ -63,11 +66,25 @@ void device_update() {
       default: break;
     }
   }
+}
+#endif
+
+// A disabled device which the guest may probe only has its present register,
+// which reads 0.
+static inline void init_absent(const char *name, uint32_t addr) {
+  uint32_t *base = (uint32_t *)new_space(sizeof(uint32_t));
+  *base = 0;
+#ifdef CONFIG_HAS_PORT_IO
+  add_pio_map (name, addr, base, sizeof(uint32_t), NULL);
+#else
+  add_mmio_map(name, addr, base, sizeof(uint32_t), NULL);
 #endif
 }
 
+#define CTL_ADDR(dev) MUXDEF(CONFIG_HAS_PORT_IO, concat3(CONFIG_, dev, _CTL_PORT), concat3(CONFIG_, dev, _CTL_MMIO))
+
 void sdl_clear_event_queue() {
-#ifndef CONFIG_TARGET_AM
+#ifdef CONFIG_HAS_SDL
   SDL_Event event;
   while (SDL_PollEvent(&event));
 #endif
@@ -76,6 +93,9 @@ void sdl_clear_event_queue() {
 void init_device() {
   IFDEF(CONFIG_TARGET_AM, ioe_init());
   init_map();
+  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  IFDEF(CONFIG_HAS_CLINT, init_clint());
+  IFDEF(CONFIG_HAS_PLIC, init_plic());
 
   IFDEF(CONFIG_HAS_SERIAL, init_serial());
   IFDEF(CONFIG_HAS_TIMER, init_timer());
@@ -83,7 +103,12 @@ void init_device() {
   IFDEF(CONFIG_HAS_KEYBOARD, init_i8042());
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
+  IFNDEF(CONFIG_HAS_DISK, init_absent("disk", CTL_ADDR(DISK)));
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
+  IFDEF(CONFIG_HAS_NET, init_net());
+  IFNDEF(CONFIG_HAS_NET, init_absent("net", CTL_ADDR(NET)));
+  IFDEF(CONFIG_HAS_VIRTIO_BLK, init_virtio_blk());
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, init_virtio_console());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  IFDEF(CONFIG_HAS_SDL, event_add("sdl", EVENT_HOST, 0, 1000000 / TIMER_HZ, sdl_poll_event));
 }
@@ -14,6 +14,119 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <device/intr.h>
+#include <device/blkdev.h>
+#include <memory/paddr.h>
+#include <cpu/replay.h>
+
+#define BLKSZ 512
+
+// The guest fills in the buffer address and the block range, then writes
+// the command register. The whole transfer is done by the host without
+// per-word PIO, and `reg_status` reads 0 until it completes. If `reg_intr`
+// is set, the interrupt line is raised after the command, and the guest
+// acknowledges it by writing `reg_status`.
+enum {
+  reg_present,
+  reg_blksz,
+  reg_blkcnt,
+  reg_buf,
+  reg_blkno,
+  reg_count,
+  reg_cmd,
+  reg_status,
+  reg_intr,
+  nr_reg
+};
+
+enum { DISK_CMD_NONE, DISK_CMD_READ, DISK_CMD_WRITE, DISK_CMD_FLUSH };
+
+static uint32_t *disk_base = NULL;
+static BlkDev *disk_dev = NULL;
+static bool busy = false;
+// the buffer of the read in flight, for difftest
+static paddr_t read_buf = 0;
+static uint32_t read_len = 0;
+
+static void disk_done(void *arg) {
+  // the reference design does not know about the disk
+  IFDEF(CONFIG_DIFFTEST, if (read_len != 0) ref_difftest_memcpy(read_buf, guest_to_host(read_buf), read_len, DIFFTEST_TO_REF));
+  IFDEF(CONFIG_REPLAY, replay_record_dma(read_buf, read_len));
+  read_len = 0;
+  busy = false;
+  disk_base[reg_status] = 1;
+  if (disk_base[reg_intr]) dev_set_irq(IRQ_DISK, true);
+}
+
+static void disk_transfer(bool is_write) {
+  paddr_t buf = disk_base[reg_buf];
+  uint32_t blkno = disk_base[reg_blkno];
+  uint32_t count = disk_base[reg_count];
+  uint32_t len = count * BLKSZ;
+  if (len == 0) { disk_done(NULL); return; }
+
+  Assert(disk_dev != NULL, "disk is not present");
+  Assert((uint64_t)blkno + count <= disk_base[reg_blkcnt],
+      "block range [%u, %u) is out of bound of disk (%u blocks)",
+      blkno, blkno + count, disk_base[reg_blkcnt]);
+  Assert(in_pmem(buf) && in_pmem(buf + len - 1),
+      "disk buffer [" FMT_PADDR ", " FMT_PADDR "] is out of bound of pmem",
+      buf, buf + len - 1);
+
+  if (!is_write) { read_buf = buf; read_len = len; }
+  blkdev_submit(disk_dev, is_write, (uint64_t)blkno * BLKSZ, len, guest_to_host(buf), disk_done, NULL);
+}
+
+static void disk_io_handler(uint32_t offset, int len, bool is_write) {
+  if (!is_write) return;
+  if (offset == reg_status * sizeof(uint32_t)) {
+    // acknowledge the interrupt
+    disk_base[reg_status] = !busy;
+    dev_set_irq(IRQ_DISK, false);
+    return;
+  }
+  if (offset != reg_cmd * sizeof(uint32_t)) return;
+  uint32_t cmd = disk_base[reg_cmd];
+  disk_base[reg_cmd] = DISK_CMD_NONE;
+  // a command is ignored while the previous one is in progress
+  if (cmd == DISK_CMD_NONE || busy) return;
+
+  busy = true;
+  disk_base[reg_status] = 0;
+  switch (cmd) {
+    case DISK_CMD_READ:  disk_transfer(false); break;
+    case DISK_CMD_WRITE: disk_transfer(true); break;
+    case DISK_CMD_FLUSH:
+      if (disk_dev != NULL) blkdev_flush(disk_dev, disk_done, NULL);
+      else disk_done(NULL);
+      break;
+    default: panic("unsupported disk command = %d", cmd);
+  }
+}
+
+static void init_disk_img() {
+  const char *img = CONFIG_DISK_IMG_PATH;
+  if (img[0] == '\0') return;
+
+  disk_dev = blkdev_open("disk", img);
+  if (disk_dev == NULL) { Log("Can not open disk image: %s", img); return; }
+
+  uint64_t nr_blk = blkdev_size(disk_dev) / BLKSZ;
+  disk_base[reg_present] = (nr_blk > 0);
+  disk_base[reg_blkcnt] = nr_blk;
+  Log("Disk image is %s, blocks = %u", img, disk_base[reg_blkcnt]);
+}
 
 void init_disk() {
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  disk_base = (uint32_t *)new_space(space_size);
+  memset(disk_base, 0, space_size);
+  disk_base[reg_blksz] = BLKSZ;
+  disk_base[reg_status] = 1; // ready
+#ifdef CONFIG_HAS_PORT_IO
+  add_pio_map ("disk", CONFIG_DISK_CTL_PORT, disk_base, space_size, disk_io_handler);
+#else
+  add_mmio_map("disk", CONFIG_DISK_CTL_MMIO, disk_base, space_size, disk_io_handler);
+#endif
+  init_disk_img();
 }
@@ -0,0 +1,165 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+#include <device/alarm.h>
+
+#define MAX_EVENT 32
+
+typedef struct {
+  const char *name;
+  uint64_t deadline;
+  uint64_t period;
+  event_handler_t handler;
+} Event;
+
+// one min-heap ordered by deadline for each clock
+typedef struct {
+  Event e[MAX_EVENT];
+  int n;
+} EventHeap;
+
+static EventHeap heap[NR_EVENT_CLOCK] = {};
+uint64_t event_deadline = UINT64_MAX;
+extern uint64_t g_nr_guest_inst;
+
+#if defined(CONFIG_ALARM_VIRTUAL)
+// In virtual time, CONFIG_ALARM_VIRTUAL_INTERVAL guest instructions
+// stand for 1 / TIMER_HZ second of the host time.
+#define INST_PER_SEC ((uint64_t)CONFIG_ALARM_VIRTUAL_INTERVAL * TIMER_HZ)
+static uint64_t us_to_inst(uint64_t us) {
+  return (us == UINT64_MAX ? UINT64_MAX : (__uint128_t)us * INST_PER_SEC / 1000000);
+}
+#elif defined(CONFIG_TARGET_AM)
+// There is no timer thread on AM. Check the host time every such number
+// of guest instructions when there are pending host events.
+#define HOST_POLL_INTERVAL 1024
+#else
+// Set by the timer thread when the earliest host event is due.
+static bool host_pending = false;
+void alarm_set(uint64_t us);
+#endif
+
+uint64_t event_host_time() {
+  return MUXDEF(CONFIG_ALARM_VIRTUAL,
+      (__uint128_t)g_nr_guest_inst * 1000000 / INST_PER_SEC, get_time());
+}
+
+static uint64_t clock_now(int clock) {
+  return (clock == EVENT_INST ? g_nr_guest_inst : event_host_time());
+}
+
+static void heap_push(EventHeap *h, Event *e) {
+  Assert(h->n < MAX_EVENT, "too many events");
+  int i = h->n ++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (h->e[parent].deadline <= e->deadline) break;
+    h->e[i] = h->e[parent];
+    i = parent;
+  }
+  h->e[i] = *e;
+}
+
+static Event heap_pop(EventHeap *h) {
+  Event top = h->e[0];
+  Event last = h->e[-- h->n];
+  int i = 0;
+  while (true) {
+    int child = 2 * i + 1;
+    if (child >= h->n) break;
+    if (child + 1 < h->n && h->e[child + 1].deadline < h->e[child].deadline) child ++;
+    if (last.deadline <= h->e[child].deadline) break;
+    h->e[i] = h->e[child];
+    i = child;
+  }
+  if (h->n > 0) h->e[i] = last;
+  return top;
+}
+
+static uint64_t heap_top(EventHeap *h) {
+  return (h->n > 0 ? h->e[0].deadline : UINT64_MAX);
+}
+
+static void update_deadline() {
+  uint64_t deadline = heap_top(&heap[EVENT_INST]);
+  uint64_t host = heap_top(&heap[EVENT_HOST]);
+#if defined(CONFIG_ALARM_VIRTUAL)
+  uint64_t host_inst = us_to_inst(host);
+  if (host_inst < deadline) deadline = host_inst;
+#elif defined(CONFIG_TARGET_AM)
+  uint64_t poll = g_nr_guest_inst + HOST_POLL_INTERVAL;
+  if (host != UINT64_MAX && poll < deadline) deadline = poll;
+#else
+  alarm_set(host);
+#endif
+  __atomic_store_n(&event_deadline, deadline, __ATOMIC_SEQ_CST);
+#if !defined(CONFIG_ALARM_VIRTUAL) && !defined(CONFIG_TARGET_AM)
+  // do not lose a kick from the timer thread which comes during the update
+  if (__atomic_load_n(&host_pending, __ATOMIC_SEQ_CST)) event_kick();
+#endif
+}
+
+void event_kick() {
+#if !defined(CONFIG_ALARM_VIRTUAL) && !defined(CONFIG_TARGET_AM)
+  __atomic_store_n(&host_pending, true, __ATOMIC_SEQ_CST);
+#endif
+  __atomic_store_n(&event_deadline, 0, __ATOMIC_SEQ_CST);
+}
+
+void event_add(const char *name, int clock, uint64_t delay, uint64_t period, event_handler_t h) {
+  assert(clock >= 0 && clock < NR_EVENT_CLOCK);
+  Event e = { .name = name, .deadline = clock_now(clock) + delay, .period = period, .handler = h };
+  heap_push(&heap[clock], &e);
+  update_deadline();
+}
+
+// Remove all events with the handler `handler`.
+void event_cancel(event_handler_t handler) {
+  int clock;
+  for (clock = 0; clock < NR_EVENT_CLOCK; clock ++) {
+    EventHeap *h = &heap[clock];
+    EventHeap old = *h;
+    h->n = 0;
+    int i;
+    for (i = 0; i < old.n; i ++) {
+      if (old.e[i].handler != handler) heap_push(h, &old.e[i]);
+    }
+  }
+  update_deadline();
+}
+
+void event_update() {
+#if !defined(CONFIG_ALARM_VIRTUAL) && !defined(CONFIG_TARGET_AM)
+  __atomic_store_n(&host_pending, false, __ATOMIC_SEQ_CST);
+#endif
+  int clock;
+  for (clock = 0; clock < NR_EVENT_CLOCK; clock ++) {
+    EventHeap *h = &heap[clock];
+    uint64_t now = clock_now(clock);
+    while (heap_top(h) <= now) {
+      Event e = heap_pop(h);
+      if (e.period != 0) {
+        // skip the missed periods instead of firing them in a burst
+        Event next = e;
+        next.deadline += e.period;
+        if (next.deadline <= now) next.deadline = now + e.period;
+        heap_push(h, &next);
+      }
+      e.handler();
+    }
+  }
+  update_deadline();
+}
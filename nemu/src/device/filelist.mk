@@ -14,19 +14,35 @@
 #**************************************************************************************/
 
 DIRS-y += src/device/io
-SRCS-$(CONFIG_DEVICE) += src/device/device.c src/device/alarm.c src/device/intr.c
+SRCS-$(CONFIG_DEVICE) += src/device/device.c src/device/alarm.c src/device/event.c src/device/intr.c
+SRCS-$(CONFIG_DEVICE_PROFILE) += src/device/profile.c
+SRCS-$(CONFIG_HAS_CLINT) += src/device/clint.c
+SRCS-$(CONFIG_HAS_PLIC) += src/device/plic.c
 SRCS-$(CONFIG_HAS_SERIAL) += src/device/serial.c
 SRCS-$(CONFIG_HAS_TIMER) += src/device/timer.c
 SRCS-$(CONFIG_HAS_KEYBOARD) += src/device/keyboard.c
 SRCS-$(CONFIG_HAS_VGA) += src/device/vga.c
 SRCS-$(CONFIG_HAS_AUDIO) += src/device/audio.c
+SRCS-$(CONFIG_BLKDEV) += src/device/blkdev.c
 SRCS-$(CONFIG_HAS_DISK) += src/device/disk.c
 SRCS-$(CONFIG_HAS_SDCARD) += src/device/sdcard.c
+SRCS-$(CONFIG_HAS_NET) += src/device/net.c
+SRCS-$(CONFIG_VIRTIO) += src/device/virtio/virtio-mmio.c
+SRCS-$(CONFIG_HAS_VIRTIO_BLK) += src/device/virtio/virtio-blk.c
+SRCS-$(CONFIG_HAS_VIRTIO_CONSOLE) += src/device/virtio/virtio-console.c
 
 SRCS-BLACKLIST-$(CONFIG_TARGET_AM) += src/device/alarm.c
 
 ifdef CONFIG_DEVICE
 ifndef CONFIG_TARGET_AM
+LIBS += -lpthread
+endif
+endif
+
+ifdef CONFIG_HAS_SDL
 LIBS += -lSDL2
 endif
+
+ifdef CONFIG_VGA_SHM
+LIBS += -lrt
 endif
@@ -14,6 +14,35 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <device/intr.h>
 
+uint32_t g_intr_lines = 0;
+
+void intr_set_line(uint32_t line, bool level) {
+  if (level) g_intr_lines |= line;
+  else g_intr_lines &= ~line;
+}
+
+#ifdef CONFIG_HAS_PLIC
+void plic_set_level(int irq, bool level);
+#else
+// Without a PLIC, the external line is the OR of all device lines.
+static uint32_t irq_levels = 0;
+#endif
+
+void dev_set_irq(int irq, bool level) {
+  assert(irq > IRQ_NONE && irq < NR_IRQ);
+#ifdef CONFIG_HAS_PLIC
+  plic_set_level(irq, level);
+#else
+  if (level) irq_levels |= (1u << irq);
+  else irq_levels &= ~(1u << irq);
+  intr_set_line(INTR_LINE_EXT, irq_levels != 0);
+#endif
+}
+
+// The periodic timer tick without acknowledgement. The ISA lowers
+// the line when the interrupt is taken.
 void dev_raise_intr() {
+  intr_set_line(INTR_LINE_TIMER, true);
 }
@@ -17,6 +17,7 @@
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#include <cpu/replay.h>
 
 #define IO_SPACE_MAX (2 * 1024 * 1024)
 
@@ -42,10 +43,6 @@ static void check_bound(IOMap *map, paddr_t addr) {
   }
 }
 
-static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_write) {
-  if (c != NULL) { c(offset, len, is_write); }
-}
-
 void init_map() {
   io_space = malloc(IO_SPACE_MAX);
   assert(io_space);
@@ -55,9 +52,11 @@ void init_map() {
 word_t map_read(paddr_t addr, int len, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
+  IFDEF(CONFIG_REPLAY, if (replay_active(REPLAY_CHECK)) return replay_read(addr, len));
   paddr_t offset = addr - map->low;
-  invoke_callback(map->callback, offset, len, false); // prepare data to read
+  map_invoke_callback(map, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
+  IFDEF(CONFIG_REPLAY, if (replay_active(REPLAY_RECORD)) replay_record_read(addr, len, ret));
   return ret;
 }
 
@@ -66,5 +65,5 @@ void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
-  invoke_callback(map->callback, offset, len, true);
+  map_invoke_callback(map, offset, len, true);
 }
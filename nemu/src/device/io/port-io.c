@@ -13,7 +13,10 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
 #include <device/map.h>
+#include <memory/host.h>
+#include <cpu/replay.h>
 
 #define PORT_IO_SPACE_MAX 65535
 
@@ -21,29 +24,99 @@
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
+// `port_map[port]` is the index of the map containing `port` plus one,
+// or 0 if the port is not mapped. This makes dispatching O(1).
+static uint8_t port_map[PORT_IO_SPACE_MAX + 1] = {};
+static uint64_t port_count[PORT_IO_SPACE_MAX + 1] = {};
+
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
   assert(nr_map < NR_MAP);
   assert(addr + len <= PORT_IO_SPACE_MAX);
+  uint32_t i;
+  for (i = addr; i < addr + len; i ++) {
+    if (port_map[i] != 0) {
+      IOMap *m = &maps[port_map[i] - 1];
+      panic("port-io region %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped "
+          "with %s@[" FMT_PADDR ", " FMT_PADDR "]", name, addr, addr + len - 1, m->name, m->low, m->high);
+    }
+  }
+
   maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
   Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
+  IFDEF(CONFIG_DEVICE_PROFILE, map_profile_add(&maps[nr_map]));
   nr_map ++;
+  for (i = addr; i < addr + len; i ++) port_map[i] = nr_map;
+}
+
+static inline IOMap* fetch_pio_map(ioaddr_t addr, int len) {
+  // checked even without RT_CHECK, since port_map is indexed with it
+  assert(addr + len - 1 < PORT_IO_SPACE_MAX);
+  int id = port_map[addr];
+  Assert(id != 0, "port (" FMT_PADDR ") is not mapped at pc = " FMT_WORD, addr, cpu.pc);
+  // the whole access should fall into the same map
+  assert(port_map[addr + len - 1] == id);
+  port_count[addr] ++;
+  difftest_skip_ref();
+  return &maps[id - 1];
+}
+
+// Specialized with a constant `len` by the callers below,
+// so that host_read() and host_write() are reduced to a single access.
+static inline __attribute__((always_inline)) uint32_t pio_read_len(ioaddr_t addr, int len) {
+  IOMap *map = fetch_pio_map(addr, len);
+  IFDEF(CONFIG_REPLAY, if (replay_active(REPLAY_CHECK)) return replay_read(addr, len));
+  paddr_t offset = addr - map->low;
+  map_invoke_callback(map, offset, len, false); // prepare data to read
+  uint32_t data = host_read(map->space + offset, len);
+  IFDEF(CONFIG_REPLAY, if (replay_active(REPLAY_RECORD)) replay_record_read(addr, len, data));
+  return data;
+}
+
+static inline __attribute__((always_inline)) void pio_write_len(ioaddr_t addr, int len, uint32_t data) {
+  IOMap *map = fetch_pio_map(addr, len);
+  paddr_t offset = addr - map->low;
+  host_write(map->space + offset, len, data);
+  map_invoke_callback(map, offset, len, true);
 }
 
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
-  assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  switch (len) {
+    case 1: return pio_read_len(addr, 1);
+    case 2: return pio_read_len(addr, 2);
+    case 4: return pio_read_len(addr, 4);
+    default: panic("invalid length %d of port-io read at port " FMT_PADDR, len, addr);
+  }
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
-  assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  switch (len) {
+    case 1: pio_write_len(addr, 1, data); return;
+    case 2: pio_write_len(addr, 2, data); return;
+    case 4: pio_write_len(addr, 4, data); return;
+    default: panic("invalid length %d of port-io write at port " FMT_PADDR, len, addr);
+  }
+}
+
+// Report the most frequently accessed ports.
+void pio_statistic() {
+  enum { NR_TOP = 8 };
+  uint32_t top[NR_TOP];
+  int n = 0, i;
+  uint32_t port;
+  for (port = 0; port <= PORT_IO_SPACE_MAX; port ++) {
+    if (port_count[port] == 0) continue;
+    // insert into the top list sorted by count
+    if (n < NR_TOP) n ++;
+    else if (port_count[top[NR_TOP - 1]] >= port_count[port]) continue;
+    for (i = n - 1; i > 0 && port_count[top[i - 1]] < port_count[port]; i --) top[i] = top[i - 1];
+    top[i] = port;
+  }
+  for (i = 0; i < n; i ++) {
+    Log("port " FMT_PADDR " {%s}: %" PRIu64 " accesses", top[i], maps[port_map[top[i]] - 1].name, port_count[top[i]]);
+  }
 }
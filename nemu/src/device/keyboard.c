@@ -19,8 +19,6 @@
 #define KEYDOWN_MASK 0x8000
 
 #ifndef CONFIG_TARGET_AM
-#include <SDL2/SDL.h>
-
 // Note that this is not the standard
 #define NEMU_KEYS(f) \
   f(ESCAPE) f(F1) f(F2) f(F3) f(F4) f(F5) f(F6) f(F7) f(F8) f(F9) f(F10) f(F11) f(F12) \
@@ -38,38 +36,137 @@ enum {
   MAP(NEMU_KEYS, NEMU_KEY_NAME)
 };
 
+#ifdef CONFIG_KEYBOARD_SDL
+#include <SDL2/SDL.h>
+
 #define SDL_KEYMAP(k) keymap[SDL_SCANCODE_ ## k] = NEMU_KEY_ ## k;
 static uint32_t keymap[256] = {};
 
 static void init_keymap() {
   MAP(NEMU_KEYS, SDL_KEYMAP)
 }
+#endif
 
+// A lock-free single-producer single-consumer ring. The producer is the
+// SDL event handler, the input thread or the replay event, and the consumer
+// is the guest reading the data port.
 #define KEY_QUEUE_LEN 1024
-static int key_queue[KEY_QUEUE_LEN] = {};
-static int key_f = 0, key_r = 0;
+static uint32_t key_queue[KEY_QUEUE_LEN] = {};
+static uint32_t key_f = 0, key_r = 0; // free-running indices
+static uint32_t last_key = NEMU_KEY_NONE;
+static uint64_t nr_drop = 0;
 
 static void key_enqueue(uint32_t am_scancode) {
-  key_queue[key_r] = am_scancode;
-  key_r = (key_r + 1) % KEY_QUEUE_LEN;
-  Assert(key_r != key_f, "key queue overflow!");
+  // coalesce repeated events of a held key
+  if (am_scancode == last_key) return;
+  uint32_t f = __atomic_load_n(&key_f, __ATOMIC_ACQUIRE);
+  uint32_t nr_free = KEY_QUEUE_LEN - (key_r - f);
+  // keep the last slot for releasing keys, so no key is stuck when full
+  if (nr_free == 0 || (nr_free == 1 && (am_scancode & KEYDOWN_MASK))) {
+    if (nr_drop ++ == 0) Log("key queue is full, dropping key events");
+    return;
+  }
+  key_queue[key_r % KEY_QUEUE_LEN] = am_scancode;
+  __atomic_store_n(&key_r, key_r + 1, __ATOMIC_RELEASE);
+  last_key = am_scancode;
 }
 
 static uint32_t key_dequeue() {
   uint32_t key = NEMU_KEY_NONE;
-  if (key_f != key_r) {
-    key = key_queue[key_f];
-    key_f = (key_f + 1) % KEY_QUEUE_LEN;
+  uint32_t r = __atomic_load_n(&key_r, __ATOMIC_ACQUIRE);
+  if (key_f != r) {
+    key = key_queue[key_f % KEY_QUEUE_LEN];
+    __atomic_store_n(&key_f, key_f + 1, __ATOMIC_RELEASE);
   }
   return key;
 }
 
+#ifdef CONFIG_KEYBOARD_SDL
 void send_key(uint8_t scancode, bool is_keydown) {
   if (nemu_state.state == NEMU_RUNNING && keymap[scancode] != NEMU_KEY_NONE) {
     uint32_t am_scancode = keymap[scancode] | (is_keydown ? KEYDOWN_MASK : 0);
     key_enqueue(am_scancode);
   }
 }
+#else
+#include <device/event.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NEMU_KEY_STR(k) [NEMU_KEY_ ## k] = #k,
+static const char *key_names[] = { MAP(NEMU_KEYS, NEMU_KEY_STR) };
+
+typedef struct {
+  uint64_t time;
+  uint32_t am_scancode;
+} KeyEvent;
+
+static KeyEvent *script = NULL;
+static int nr_script = 0, script_idx = 0;
+
+static void load_script(const char *path) {
+  FILE *fp = fopen(path, "r");
+  Assert(fp, "Can not open key event script: %s", path);
+  int cap = 64;
+  script = malloc(sizeof(KeyEvent) * cap);
+  char line[128], name[32], state[8];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineno ++;
+    uint64_t time;
+    if (line[0] == '#' || line[0] == '\n') continue;
+    int ret = sscanf(line, "%" SCNu64 " %31s %7s", &time, name, state);
+    Assert(ret == 3, "%s:%d: invalid key event", path, lineno);
+    uint32_t key;
+    for (key = 1; key < ARRLEN(key_names); key ++) {
+      if (strcmp(key_names[key], name) == 0) break;
+    }
+    Assert(key < ARRLEN(key_names), "%s:%d: unknown key %s", path, lineno, name);
+    Assert(nr_script == 0 || time >= script[nr_script - 1].time,
+        "%s:%d: timestamps must not decrease", path, lineno);
+    if (nr_script == cap) { cap *= 2; script = realloc(script, sizeof(KeyEvent) * cap); }
+    script[nr_script ++] = (KeyEvent) {
+      .time = time, .am_scancode = key | (strcmp(state, "down") == 0 ? KEYDOWN_MASK : 0) };
+  }
+  fclose(fp);
+  Log("Key event script is %s, %d events", path, nr_script);
+}
+
+#ifdef CONFIG_KEYBOARD_REPLAY
+extern uint64_t g_nr_guest_inst;
+
+static void replay_key() {
+  while (script_idx < nr_script && script[script_idx].time <= g_nr_guest_inst) {
+    key_enqueue(script[script_idx ++].am_scancode);
+  }
+  if (script_idx < nr_script) {
+    event_add("key-replay", EVENT_INST, script[script_idx].time - g_nr_guest_inst, 0, replay_key);
+  }
+}
+
+static void init_key_source() {
+  load_script(CONFIG_KEYBOARD_SCRIPT_PATH);
+  if (nr_script > 0) event_add("key-replay", EVENT_INST, script[0].time, 0, replay_key);
+}
+#else
+static void* key_thread(void *arg) {
+  for (; script_idx < nr_script; script_idx ++) {
+    uint64_t now = get_time();
+    if (script[script_idx].time > now) usleep(script[script_idx].time - now);
+    key_enqueue(script[script_idx].am_scancode);
+  }
+  return NULL;
+}
+
+static void init_key_source() {
+  load_script(CONFIG_KEYBOARD_SCRIPT_PATH);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, key_thread, NULL);
+  Assert(ret == 0, "Can not create key input thread");
+  pthread_detach(thread);
+}
+#endif
+#endif
 #else // !CONFIG_TARGET_AM
 #define NEMU_KEY_NONE 0
 
@@ -96,5 +193,8 @@ void init_i8042() {
 #else
   add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
 #endif
-  IFNDEF(CONFIG_TARGET_AM, init_keymap());
+  IFDEF(CONFIG_KEYBOARD_SDL, init_keymap());
+#if !defined(CONFIG_TARGET_AM) && !defined(CONFIG_KEYBOARD_SDL)
+  init_key_source();
+#endif
 }
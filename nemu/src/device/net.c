@@ -0,0 +1,233 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/event.h>
+#include <device/intr.h>
+#include <memory/paddr.h>
+#include <cpu/replay.h>
+
+#define NET_FRAME_MAX 2048
+#define NET_POLL_US 1000
+
+// The driver owns the descriptors in [head, tail) of the TX ring and
+// bumps `tx_tail` to hand them to NEMU, which sends all of them at once
+// and advances `tx_head`. For the RX ring, the driver posts empty buffers
+// by bumping `rx_tail`. NEMU fills them in order, writes back the frame
+// length, advances `rx_head`, and raises an interrupt.
+enum {
+  reg_present,
+  reg_tx_ring,
+  reg_tx_size,
+  reg_tx_head,
+  reg_tx_tail,
+  reg_rx_ring,
+  reg_rx_size,
+  reg_rx_head,
+  reg_rx_tail,
+  reg_intr_status,
+  reg_intr,
+  nr_reg
+};
+
+enum { NET_INTR_TX = 1, NET_INTR_RX = 2 };
+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+} NetDesc;
+
+static uint32_t *net_base = NULL;
+static uint32_t intr_status = 0;
+static uint64_t nr_tx = 0, nr_rx = 0, nr_drop = 0;
+
+// A ring is checked when the driver hands descriptors in it to NEMU.
+static void net_check_ring(int ring) {
+  paddr_t base = net_base[ring];
+  uint32_t size = net_base[ring + 1];
+  Assert(size != 0 && size <= CONFIG_MSIZE / sizeof(NetDesc) &&
+      in_pmem(base) && in_pmem(base + size * sizeof(NetDesc) - 1),
+      "net %s ring [" FMT_PADDR ", +%d descriptors] is invalid",
+      (ring == reg_tx_ring ? "TX" : "RX"), base, size);
+}
+
+static paddr_t net_desc_addr(int ring, uint32_t idx) {
+  uint32_t size = net_base[ring + 1];
+  return net_base[ring] + (idx % size) * sizeof(NetDesc);
+}
+
+static NetDesc* net_desc(int ring, uint32_t idx) {
+  paddr_t addr = net_desc_addr(ring, idx);
+  Assert(in_pmem(addr) && in_pmem(addr + sizeof(NetDesc) - 1),
+      "net descriptor at " FMT_PADDR " is out of bound of pmem", addr);
+  return (NetDesc *)guest_to_host(addr);
+}
+
+static uint8_t* net_buf(NetDesc *d) {
+  Assert(d->len <= NET_FRAME_MAX && (d->len == 0 || (in_pmem(d->addr) && in_pmem(d->addr + d->len - 1))),
+      "net buffer [" FMT_PADDR ", +%d] is invalid", (paddr_t)d->addr, d->len);
+  return guest_to_host(d->addr);
+}
+
+static void net_update_irq() {
+  dev_set_irq(IRQ_NET, intr_status != 0 && net_base[reg_intr]);
+}
+
+static void net_raise_intr(uint32_t cause) {
+  intr_status |= cause;
+  net_update_irq();
+}
+
+static bool rx_ready() {
+  return net_base[reg_rx_size] != 0 && net_base[reg_rx_head] != net_base[reg_rx_tail];
+}
+
+// Deliver a frame into the next posted RX buffer. The caller checks rx_ready().
+static void rx_frame(const uint8_t *frame, uint32_t len) {
+  NetDesc *d = net_desc(reg_rx_ring, net_base[reg_rx_head]);
+  if (len > d->len) len = d->len;
+#ifdef CONFIG_REPLAY
+  // the frames received may be different, so they are taken from the log
+  if (!replay_dma_from_log())
+#endif
+  {
+    memcpy(net_buf(d), frame, len);
+    d->len = len;
+  }
+  // the reference design does not know about the network
+  IFDEF(CONFIG_DIFFTEST, ref_difftest_memcpy(d->addr, guest_to_host(d->addr), len, DIFFTEST_TO_REF));
+  IFDEF(CONFIG_DIFFTEST, ref_difftest_memcpy(net_desc_addr(reg_rx_ring, net_base[reg_rx_head]),
+        d, sizeof(*d), DIFFTEST_TO_REF));
+  IFDEF(CONFIG_REPLAY, replay_record_dma(d->addr, len));
+  IFDEF(CONFIG_REPLAY, replay_record_dma(net_desc_addr(reg_rx_ring, net_base[reg_rx_head]), sizeof(*d)));
+  net_base[reg_rx_head] ++;
+  nr_rx ++;
+}
+
+#ifdef CONFIG_NET_LOOPBACK
+// Frames sent by the guest wait here until RX buffers are posted.
+#define BACKLOG 64
+static uint8_t backlog[BACKLOG][NET_FRAME_MAX];
+static uint32_t backlog_len[BACKLOG];
+static int bl_head = 0, bl_tail = 0;
+
+static void backend_send(const uint8_t *frame, uint32_t len) {
+  if (bl_tail - bl_head == BACKLOG) { nr_drop ++; return; }
+  memcpy(backlog[bl_tail % BACKLOG], frame, len);
+  backlog_len[bl_tail % BACKLOG] = len;
+  bl_tail ++;
+}
+
+static int backend_recv() {
+  int n = 0;
+  for (; bl_head != bl_tail && rx_ready(); bl_head ++, n ++) {
+    rx_frame(backlog[bl_head % BACKLOG], backlog_len[bl_head % BACKLOG]);
+  }
+  return n;
+}
+
+static void init_backend() {
+  Log("Network backend is loopback");
+}
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int sock = -1;
+static struct sockaddr_un peer = { .sun_family = AF_UNIX };
+
+static void backend_send(const uint8_t *frame, uint32_t len) {
+  ssize_t ret = sendto(sock, frame, len, MSG_DONTWAIT, (struct sockaddr *)&peer, sizeof(peer));
+  if (ret != len) nr_drop ++; // the peer is absent or busy, just like a real link
+}
+
+// Frames are left in the socket until RX buffers are posted.
+static int backend_recv() {
+  static uint8_t frame[NET_FRAME_MAX];
+  int n = 0;
+  while (rx_ready()) {
+    ssize_t len = recv(sock, frame, sizeof(frame), MSG_DONTWAIT);
+    if (len <= 0) break;
+    rx_frame(frame, len);
+    n ++;
+  }
+  return n;
+}
+
+static void init_backend() {
+  const char *path = CONFIG_NET_SOCKET_PATH;
+  sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+  Assert(sock >= 0, "Can not create socket for network");
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  int ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  Assert(ret == 0, "Can not bind network socket to %s", path);
+  strncpy(peer.sun_path, CONFIG_NET_PEER_PATH, sizeof(peer.sun_path) - 1);
+  Log("Network backend is %s <-> %s", path, CONFIG_NET_PEER_PATH);
+}
+#endif
+
+static void net_rx() {
+  if (net_base[reg_rx_head] != net_base[reg_rx_tail]) net_check_ring(reg_rx_ring);
+  if (backend_recv() > 0) net_raise_intr(NET_INTR_RX);
+}
+
+static void net_tx() {
+  uint32_t n = 0;
+  if (net_base[reg_tx_head] != net_base[reg_tx_tail]) net_check_ring(reg_tx_ring);
+  for (; net_base[reg_tx_head] != net_base[reg_tx_tail]; net_base[reg_tx_head] ++, n ++) {
+    NetDesc *d = net_desc(reg_tx_ring, net_base[reg_tx_head]);
+    backend_send(net_buf(d), d->len);
+    nr_tx ++;
+  }
+  if (n > 0) net_raise_intr(NET_INTR_TX);
+  IFDEF(CONFIG_NET_LOOPBACK, net_rx());
+}
+
+static void net_io_handler(uint32_t offset, int len, bool is_write) {
+  switch (offset / sizeof(uint32_t)) {
+    case reg_tx_tail: if (is_write) net_tx(); break;
+    case reg_rx_tail: if (is_write) net_rx(); break;
+    case reg_intr_status:
+      // write 1 to clear
+      if (is_write) intr_status &= ~net_base[reg_intr_status];
+      net_base[reg_intr_status] = intr_status;
+      net_update_irq();
+      break;
+    case reg_intr: if (is_write) net_update_irq(); break;
+    default: break;
+  }
+}
+
+void net_statistic() {
+  Log("net tx = %" PRIu64 ", rx = %" PRIu64 ", dropped = %" PRIu64 " frames", nr_tx, nr_rx, nr_drop);
+}
+
+void init_net() {
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  net_base = (uint32_t *)new_space(space_size);
+  memset(net_base, 0, space_size);
+  net_base[reg_present] = 1;
+#ifdef CONFIG_HAS_PORT_IO
+  add_pio_map ("net", CONFIG_NET_CTL_PORT, net_base, space_size, net_io_handler);
+#else
+  add_mmio_map("net", CONFIG_NET_CTL_MMIO, net_base, space_size, net_io_handler);
+#endif
+  init_backend();
+  // there is no way for the host to signal NEMU, so check for incoming frames periodically
+  IFNDEF(CONFIG_NET_LOOPBACK, event_add("net", EVENT_HOST, NET_POLL_US, NET_POLL_US, net_rx));
+}
@@ -0,0 +1,100 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/intr.h>
+
+// https://github.com/riscv/riscv-plic-spec/blob/master/riscv-plic.adoc
+// Only one context (the machine mode of hart 0) is supported. The sources
+// are level-triggered: a source is pending when its line is high and it is
+// not being served, so it becomes pending again after the completion if
+// the device still holds the line.
+
+#define PLIC_PRIORITY  0x000000
+#define PLIC_PENDING   0x001000
+#define PLIC_ENABLE    0x002000
+#define PLIC_CTX       0x200000
+#define PLIC_THRESHOLD 0x0
+#define PLIC_CLAIM     0x4
+
+static uint32_t *priority = NULL;  // also holds the pending and enable bits
+static uint32_t *ctx_base = NULL;
+static uint32_t level = 0, pending = 0, claimed = 0;
+
+#define PENDING (priority[PLIC_PENDING / 4])
+#define ENABLE  (priority[PLIC_ENABLE / 4])
+
+// Return the enabled pending source with the highest priority above the threshold.
+static int plic_best() {
+  uint32_t threshold = ctx_base[PLIC_THRESHOLD / 4];
+  uint32_t candidate = pending & ENABLE;
+  int best = IRQ_NONE;
+  int irq;
+  for (irq = 1; irq < NR_IRQ; irq ++) {
+    if ((candidate & (1u << irq)) && priority[irq] > threshold &&
+        (best == IRQ_NONE || priority[irq] > priority[best])) best = irq;
+  }
+  return best;
+}
+
+static void plic_update() {
+  pending |= level & ~claimed;
+  PENDING = pending;
+  intr_set_line(INTR_LINE_EXT, plic_best() != IRQ_NONE);
+}
+
+void plic_set_level(int irq, bool high) {
+  if (high) level |= (1u << irq);
+  else level &= ~(1u << irq);
+  plic_update();
+}
+
+static void plic_io_handler(uint32_t offset, int len, bool is_write) {
+  if (is_write) {
+    PENDING = pending; // the pending bits are read-only
+    plic_update();
+  }
+}
+
+static void plic_ctx_io_handler(uint32_t offset, int len, bool is_write) {
+  assert(len == 4);
+  if (offset == PLIC_CLAIM) {
+    if (!is_write) {
+      // claim
+      int irq = plic_best();
+      ctx_base[PLIC_CLAIM / 4] = irq;
+      if (irq != IRQ_NONE) {
+        pending &= ~(1u << irq);
+        claimed |= (1u << irq);
+      }
+    } else {
+      // complete
+      uint32_t irq = ctx_base[PLIC_CLAIM / 4];
+      if (irq < NR_IRQ) claimed &= ~(1u << irq);
+    }
+  }
+  plic_update();
+}
+
+void init_plic() {
+  uint32_t size = PLIC_ENABLE + 4;
+  priority = (uint32_t *)new_space(size);
+  memset(priority, 0, size);
+  add_mmio_map("plic", CONFIG_PLIC_MMIO, priority, size, plic_io_handler);
+
+  ctx_base = (uint32_t *)new_space(8);
+  memset(ctx_base, 0, 8);
+  add_mmio_map("plic-ctx", CONFIG_PLIC_MMIO + PLIC_CTX, ctx_base, 8, plic_ctx_io_handler);
+}
@@ -0,0 +1,123 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/event.h>
+#include <time.h>
+
+#define NR_PROFILE_MAP 32
+
+static IOMap *profiled[NR_PROFILE_MAP] = {};
+static int nr_profiled = 0;
+
+void map_profile_add(IOMap *map) {
+  assert(nr_profiled < NR_PROFILE_MAP);
+  memset(&map->prof, 0, sizeof(map->prof));
+  profiled[nr_profiled ++] = map;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void map_profile_callback(IOMap *map, paddr_t offset, int len, bool is_write) {
+  IOProfile *p = &map->prof;
+  p->nr[is_write] ++;
+  p->bytes[is_write] += len;
+  if (map->callback == NULL) return;
+
+  uint64_t start = now_ns();
+  map->callback(offset, len, is_write);
+  uint64_t ns = now_ns() - start;
+  p->ns += ns;
+  int bucket = (ns == 0 ? 0 : 63 - __builtin_clzll(ns));
+  p->hist[bucket < NR_PROFILE_BUCKET ? bucket : NR_PROFILE_BUCKET - 1] ++;
+}
+
+void map_profile_display() {
+  printf("%-16s %12s %12s %12s %12s %14s %10s\n",
+      "device", "reads", "writes", "read bytes", "write bytes", "callback (us)", "ns/access");
+  int i, b;
+  for (i = 0; i < nr_profiled; i ++) {
+    IOProfile *p = &profiled[i]->prof;
+    uint64_t nr = p->nr[0] + p->nr[1];
+    printf("%-16s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %10" PRIu64 "\n",
+        profiled[i]->name, p->nr[0], p->nr[1], p->bytes[0], p->bytes[1],
+        p->ns / 1000, (nr == 0 ? 0 : p->ns / nr));
+  }
+
+  printf("\ncallback latency histogram, bucket b counts [2^b, 2^(b+1)) ns\n");
+  for (i = 0; i < nr_profiled; i ++) {
+    IOProfile *p = &profiled[i]->prof;
+    if (profiled[i]->callback == NULL || p->nr[0] + p->nr[1] == 0) continue;
+    printf("%-16s", profiled[i]->name);
+    for (b = 0; b < NR_PROFILE_BUCKET; b ++) {
+      if (p->hist[b] != 0) printf(" %d:%" PRIu64, b, p->hist[b]);
+    }
+    printf("\n");
+  }
+}
+
+void map_profile_dump() {
+  const char *path = CONFIG_DEVICE_PROFILE_JSON;
+  if (path[0] == '\0') return;
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) { Log("Can not open %s to dump the device profile", path); return; }
+
+  int i, b;
+  fprintf(fp, "{\n  \"devices\": [");
+  for (i = 0; i < nr_profiled; i ++) {
+    IOMap *map = profiled[i];
+    IOProfile *p = &map->prof;
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"low\": %" PRIu64 ", \"high\": %" PRIu64
+        ", \"reads\": %" PRIu64 ", \"writes\": %" PRIu64
+        ", \"read_bytes\": %" PRIu64 ", \"write_bytes\": %" PRIu64
+        ", \"callback_ns\": %" PRIu64 ", \"latency_log2_ns\": [",
+        (i == 0 ? "" : ","), map->name, (uint64_t)map->low, (uint64_t)map->high,
+        p->nr[0], p->nr[1], p->bytes[0], p->bytes[1], p->ns);
+    for (b = 0; b < NR_PROFILE_BUCKET; b ++) {
+      fprintf(fp, "%s%" PRIu64, (b == 0 ? "" : ", "), p->hist[b]);
+    }
+    fprintf(fp, "]}");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  Log("Device profile is dumped to %s", path);
+}
+
+// Report the access rate and the callback time of each busy device
+// during the last second.
+static void map_profile_rate() {
+  char buf[1024];
+  char *p = buf;
+  int i;
+  for (i = 0; i < nr_profiled; i ++) {
+    IOProfile *prof = &profiled[i]->prof;
+    uint64_t nr = prof->nr[0] + prof->nr[1];
+    uint64_t dnr = nr - prof->last_nr, dns = prof->ns - prof->last_ns;
+    prof->last_nr = nr;
+    prof->last_ns = prof->ns;
+    if (dnr == 0 || p >= buf + sizeof(buf)) continue;
+    p += snprintf(p, buf + sizeof(buf) - p, " %s %" PRIu64 "/s %" PRIu64 ".%03" PRIu64 "ms/s;",
+        profiled[i]->name, dnr, dns / 1000000, dns / 1000 % 1000);
+  }
+  if (p != buf) Log("device rate:%s", buf);
+}
+
+void map_profile_start_rate() {
+  event_add("device-profile", EVENT_HOST, 1000000, 1000000, map_profile_rate);
+}
@@ -14,6 +14,9 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <device/blkdev.h>
+#include <memory/paddr.h>
+#include <cpu/replay.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -28,31 +31,87 @@
 #define C_SIZE (NR_BLOCK / MULT - 1)
 
 // This is a simple hardware implementation of linux/drivers/mmc/host/bcm2835.c
-// No DMA and IRQ is supported, so the driver must be modified to start PIO
+// No IRQ is supported, so the driver must be modified to start PIO
 // right after sending the actual read/write commands.
+// Besides PIO through SDDATA, the driver can write a guest physical address
+// to the NEMU-specific register SDDMA before sending the read/write command.
+// Then all blocks of the command are transferred at once, and SDDMA is cleared
+// when all transfers in flight complete. The data written by the guest may stay in the
+// cache of the host until MMC_STOP_TRANSMISSION.
 
 enum {
   SDCMD, SDARG, SDTOUT, SDCDIV,
   SDRSP0, SDRSP1, SDRSP2, SDRSP3,
   SDHSTS, __PAD0, __PAD1, __PAD2,
   SDVDD, SDEDM, SDHCFG, SDHBCT,
-  SDDATA, __PAD10, __PAD11, __PAD12,
+  SDDATA, SDDMA, __PAD11, __PAD12,
   SDHBLC
 };
 
-static FILE *fp = NULL;
+static BlkDev *img = NULL;
 static uint32_t *base = NULL;
 static uint32_t blkcnt = 0;
-static long blk_addr = 0;
+static uint64_t blk_addr = 0;
 static uint32_t addr = 0;
 static bool write_cmd = 0;
 static bool read_ext_csd = false;
+static uint64_t nr_read_bytes = 0, nr_write_bytes = 0;
 
-static void prepare_rw(int is_write) {
+// Return whether `len` bytes at offset `addr` of the current transfer
+// are inside the image, and the offset of them in the image.
+static bool img_offset(uint32_t len, uint64_t *offset) {
+  *offset = (blk_addr << 9) + addr;
+  return img != NULL && *offset + len <= blkdev_size(img);
+}
+
+// A DMA is completed later with CONFIG_BLKDEV_ASYNC, and the guest may
+// start another one before that, so each of them carries its own state.
+typedef struct {
+  paddr_t buf;
+  uint32_t len;
+  bool is_write;
+} DMAReq;
+
+static int nr_dma_pending = 0;
+
+static void dma_done(void *arg) {
+  DMAReq *r = arg;
+  if (r->is_write) nr_write_bytes += r->len;
+  else {
+    nr_read_bytes += r->len;
+    // the reference design does not know about the sdcard
+    IFDEF(CONFIG_DIFFTEST, ref_difftest_memcpy(r->buf, guest_to_host(r->buf), r->len, DIFFTEST_TO_REF));
+    IFDEF(CONFIG_REPLAY, replay_record_dma(r->buf, r->len));
+  }
+  free(r);
+  // the guest polls SDDMA until all DMAs are done
+  if (-- nr_dma_pending == 0) base[SDDMA] = 0;
+}
+
+static void dma_transfer(uint32_t nr_blk) {
+  paddr_t buf = base[SDDMA];
+  uint32_t len = nr_blk << 9;
+  uint64_t offset;
+  if (len == 0 || img == NULL) { if (nr_dma_pending == 0) base[SDDMA] = 0; return; }
+  bool in_img = img_offset(len, &offset);
+  Assert(in_img, "sdcard DMA of %d blocks at block %" PRIu64 " is out of bound of the image",
+      nr_blk, blk_addr);
+  Assert(in_pmem(buf) && in_pmem(buf + len - 1),
+      "sdcard DMA buffer [" FMT_PADDR ", " FMT_PADDR "] is out of bound of pmem",
+      buf, buf + len - 1);
+  DMAReq *r = malloc(sizeof(DMAReq));
+  assert(r);
+  *r = (DMAReq){ .buf = buf, .len = len, .is_write = write_cmd };
+  nr_dma_pending ++;
+  blkdev_submit(img, write_cmd, offset, len, guest_to_host(buf), dma_done, r);
+  addr += len;
+}
+
+static void prepare_rw(int is_write, uint32_t nr_blk) {
   blk_addr = base[SDARG];
   addr = 0;
-  if (fp) fseek(fp, blk_addr << 9, SEEK_SET);
   write_cmd = is_write;
+  if (base[SDDMA] != 0) dma_transfer(nr_blk);
 }
 
 static void sdcard_handle_cmd(int cmd) {
@@ -79,10 +138,12 @@ static void sdcard_handle_cmd(int cmd) {
     case MMC_SET_RELATIVE_ADDR: break;
     case MMC_SELECT_CARD: break;
     case MMC_SET_BLOCK_COUNT: blkcnt = base[SDARG] & 0xffff; break;
-    case MMC_READ_MULTIPLE_BLOCK: prepare_rw(false); break;
-    case MMC_WRITE_MULTIPLE_BLOCK: prepare_rw(true); break;
+    case MMC_READ_SINGLE_BLOCK: prepare_rw(false, 1); break;
+    case MMC_WRITE_BLOCK: prepare_rw(true, 1); break;
+    case MMC_READ_MULTIPLE_BLOCK: prepare_rw(false, blkcnt); break;
+    case MMC_WRITE_MULTIPLE_BLOCK: prepare_rw(true, blkcnt); break;
     case MMC_SEND_STATUS: base[SDRSP0] = 0x900; base[SDRSP1] = base[SDRSP2] = base[SDRSP3] = 0; break;
-    case MMC_STOP_TRANSMISSION: break;
+    case MMC_STOP_TRANSMISSION: if (img != NULL) blkdev_flush(img, NULL, NULL); break;
     default:
       panic("unhandled command = %d", cmd);
   }
@@ -93,6 +154,7 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   switch (idx) {
     case SDCMD: sdcard_handle_cmd(base[SDCMD] & 0x3f); break;
     case SDARG:
+    case SDDMA:
     case SDRSP0:
     case SDRSP1:
     case SDRSP2:
@@ -109,10 +171,13 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
          }
          base[SDDATA] = data;
          if (addr == 512 - 4) read_ext_csd = false;
-       } else if (fp) {
-         __attribute__((unused)) int ret;
-         if (!write_cmd) { ret = fread(&base[SDDATA], 4, 1, fp); }
-         else { ret = fwrite(&base[SDDATA], 4, 1, fp); }
+       } else {
+         uint64_t img_off;
+         if (img_offset(4, &img_off)) {
+           blkdev_rw(img, write_cmd, img_off, 4, &base[SDDATA]);
+           if (!write_cmd) nr_read_bytes += 4;
+           else nr_write_bytes += 4;
+         }
        }
        addr += 4;
        break;
@@ -124,11 +189,19 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
 
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
+  memset(base, 0, 0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
 
   Assert(C_SIZE < (1 << 12), "shoule be fit in 12 bits");
 
-  const char *img = CONFIG_SDCARD_IMG_PATH;
-  fp = fopen(img, "r+");
-  if (fp == NULL) Log("Can not find sdcard image: %s", img);
+  const char *path = CONFIG_SDCARD_IMG_PATH;
+  img = blkdev_open("sdcard", path);
+  if (img == NULL) { Log("Can not find sdcard image: %s", path); return; }
+}
+
+void sdcard_statistic(uint64_t host_us) {
+  Log("sdcard read = " NUMBERIC_FMT " bytes, write = " NUMBERIC_FMT " bytes",
+      nr_read_bytes, nr_write_bytes);
+  if (host_us > 0) Log("sdcard throughput = " NUMBERIC_FMT " bytes/s",
+      (nr_read_bytes + nr_write_bytes) * 1000000 / host_us);
 }
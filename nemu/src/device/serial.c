@@ -15,17 +15,110 @@
 
 #include <utils.h>
 #include <device/map.h>
+#include <device/alarm.h>
+#include <device/event.h>
 
 /* http://en.wikibooks.org/wiki/Serial_Programming/8250_UART_Programming */
 // NOTE: this is compatible to 16550
 
 #define CH_OFFSET 0
+#define LSR_OFFSET 5
+#define LSR_RX_READY 0x01
+#define LSR_TX_READY 0x20
+#define LSR_FIFO_EMPTY 0x40
 
 static uint8_t *serial_base = NULL;
 
+#ifdef CONFIG_SERIAL_BUFFERED
+#define OBUF_SIZE 4096
+static char obuf[OBUF_SIZE] = {};
+static int obuf_len = 0;
+
+void serial_flush() {
+  if (obuf_len == 0) return;
+  __attribute__((unused)) size_t ret = fwrite(obuf, 1, obuf_len, stderr);
+  obuf_len = 0;
+}
+#endif
 
 static void serial_putc(char ch) {
+#ifdef CONFIG_SERIAL_BUFFERED
+  obuf[obuf_len ++] = ch;
+  if (ch == '\n' || obuf_len == OBUF_SIZE) serial_flush();
+#else
   MUXDEF(CONFIG_TARGET_AM, putch(ch), putc(ch, stderr));
+#endif
+}
+
+#ifdef CONFIG_SERIAL_INPUT_FIFO
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define QUEUE_SIZE 1024
+static char queue[QUEUE_SIZE] = {};
+static int f = 0, r = 0;
+static int fifo_fd = -1;
+// To avoid a syscall for every poll of LSR from the guest, the host FIFO
+// is checked again only after the next device update once it is found empty.
+static bool fifo_may_ready = true;
+
+static bool serial_queue_ready() {
+  if (f == r && fifo_fd >= 0 && fifo_may_ready) {
+    ssize_t n = read(fifo_fd, queue, QUEUE_SIZE);
+    f = 0;
+    r = (n > 0 ? n : 0);
+    if (n <= 0) {
+      fifo_may_ready = false;
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        Log("Can not read serial input FIFO, errno = %d", errno);
+        close(fifo_fd);
+        fifo_fd = -1;
+      }
+    }
+  }
+  return f != r;
+}
+
+static char serial_getc() {
+  return serial_queue_ready() ? queue[f ++] : 0xff;
+}
+
+static int open_unix_socket(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  Assert(fd >= 0, "Can not create socket for serial input");
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void init_fifo() {
+  const char *path = CONFIG_SERIAL_INPUT_PATH;
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    int ret = mkfifo(path, 0666);
+    Assert(ret == 0, "Can not create serial input FIFO: %s", path);
+    st.st_mode = S_IFIFO;
+  }
+
+  // opening a FIFO with O_NONBLOCK succeeds even if there is no writer yet
+  fifo_fd = S_ISSOCK(st.st_mode) ? open_unix_socket(path) : open(path, O_RDONLY | O_NONBLOCK);
+  if (fifo_fd < 0) Log("Can not open serial input FIFO: %s", path);
+  else Log("Serial input FIFO is %s", path);
+}
+#endif
+
+static void serial_update() {
+  IFDEF(CONFIG_SERIAL_BUFFERED, serial_flush());
+  IFDEF(CONFIG_SERIAL_INPUT_FIFO, fifo_may_ready = true);
 }
 
 static void serial_io_handler(uint32_t offset, int len, bool is_write) {
@@ -34,7 +127,13 @@ static void serial_io_handler(uint32_t offset, int len, bool is_write) {
     /* We bind the serial port with the host stderr in NEMU. */
     case CH_OFFSET:
       if (is_write) serial_putc(serial_base[0]);
-      else panic("do not support read");
+      else serial_base[0] = MUXDEF(CONFIG_SERIAL_INPUT_FIFO, serial_getc(), 0xff);
+      break;
+    case LSR_OFFSET:
+      if (!is_write) {
+        serial_base[LSR_OFFSET] = LSR_TX_READY | LSR_FIFO_EMPTY |
+          MUXDEF(CONFIG_SERIAL_INPUT_FIFO, (serial_queue_ready() ? LSR_RX_READY : 0), 0);
+      }
       break;
     default: panic("do not support offset = %d", offset);
   }
@@ -42,10 +141,13 @@ static void serial_io_handler(uint32_t offset, int len, bool is_write) {
 
 void init_serial() {
   serial_base = new_space(8);
+  memset(serial_base, 0, 8);
 #ifdef CONFIG_HAS_PORT_IO
   add_pio_map ("serial", CONFIG_SERIAL_PORT, serial_base, 8, serial_io_handler);
 #else
   add_mmio_map("serial", CONFIG_SERIAL_MMIO, serial_base, 8, serial_io_handler);
 #endif
 
+  IFDEF(CONFIG_SERIAL_INPUT_FIFO, init_fifo());
+  event_add("serial", EVENT_HOST, 1000000 / TIMER_HZ, 1000000 / TIMER_HZ, serial_update);
 }
@@ -15,34 +15,110 @@
 
 #include <device/map.h>
 #include <device/alarm.h>
+#include <device/intr.h>
 #include <utils.h>
 
+#include <device/event.h>
+#ifndef CONFIG_TARGET_AM
+#include <time.h>
+#endif
+
+// Reading `reg_us_hi` latches the uptime in microseconds into both halves,
+// and reading `reg_date` latches the wall clock into `reg_date` and `reg_time`.
+enum {
+  reg_us_lo,
+  reg_us_hi,
+  reg_date, // year << 16 | month << 8 | day
+  reg_time, // hour << 16 | minute << 8 | second
+  nr_reg
+};
+
 static uint32_t *rtc_port_base = NULL;
+#ifndef CONFIG_TARGET_AM
+static time_t boot_wall_time = 0;
+#endif
+extern uint64_t g_nr_guest_inst;
+
+#ifdef CONFIG_RTC_CACHED
+#define RTC_SAMPLE_PERIOD (1000000 / TIMER_HZ)
+
+static uint64_t sample_us = 0, sample_inst = 0;
+static uint64_t us_per_inst = 0; // in 32.32 fixed point, from the last period
+static uint64_t last_us = 0;
+
+static void rtc_sample() {
+  uint64_t us = get_time();
+  uint64_t inst = g_nr_guest_inst;
+  if (inst > sample_inst && us > sample_us) {
+    us_per_inst = ((us - sample_us) << 32) / (inst - sample_inst);
+  }
+  sample_us = us;
+  sample_inst = inst;
+}
+
+static uint64_t rtc_uptime() {
+  uint64_t delta = ((__uint128_t)(g_nr_guest_inst - sample_inst) * us_per_inst) >> 32;
+  uint64_t us = sample_us + (delta < RTC_SAMPLE_PERIOD ? delta : RTC_SAMPLE_PERIOD);
+  // the extrapolation may overshoot the next sample
+  if (us < last_us) us = last_us;
+  last_us = us;
+  return us;
+}
+#else
+static uint64_t rtc_uptime() {
+  return MUXDEF(CONFIG_RTC_VIRTUAL, event_host_time(), get_time());
+}
+#endif
+
+static void rtc_wall_clock() {
+#ifdef CONFIG_TARGET_AM
+  AM_TIMER_RTC_T rtc = io_read(AM_TIMER_RTC);
+#else
+  time_t now = boot_wall_time + rtc_uptime() / 1000000;
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  struct { int year, month, day, hour, minute, second; } rtc = {
+    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec };
+#endif
+  rtc_port_base[reg_date] = (rtc.year << 16) | (rtc.month << 8) | rtc.day;
+  rtc_port_base[reg_time] = (rtc.hour << 16) | (rtc.minute << 8) | rtc.second;
+}
 
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
-  assert(offset == 0 || offset == 4);
-  if (!is_write && offset == 4) {
-    uint64_t us = get_time();
-    rtc_port_base[0] = (uint32_t)us;
-    rtc_port_base[1] = us >> 32;
+  assert(offset < nr_reg * sizeof(uint32_t));
+  if (is_write) return;
+  switch (offset / sizeof(uint32_t)) {
+    case reg_us_hi: {
+      uint64_t us = rtc_uptime();
+      rtc_port_base[reg_us_lo] = (uint32_t)us;
+      rtc_port_base[reg_us_hi] = us >> 32;
+      break;
+    }
+    case reg_date: rtc_wall_clock(); break;
   }
 }
 
-#ifndef CONFIG_TARGET_AM
+#if !defined(CONFIG_TARGET_AM) && !defined(CONFIG_HAS_CLINT)
 static void timer_intr() {
-  if (nemu_state.state == NEMU_RUNNING) {
-    extern void dev_raise_intr();
-    dev_raise_intr();
-  }
+  dev_raise_intr();
 }
 #endif
 
 void init_timer() {
-  rtc_port_base = (uint32_t *)new_space(8);
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  rtc_port_base = (uint32_t *)new_space(space_size);
+  memset(rtc_port_base, 0, space_size);
 #ifdef CONFIG_HAS_PORT_IO
-  add_pio_map ("rtc", CONFIG_RTC_PORT, rtc_port_base, 8, rtc_io_handler);
+  add_pio_map ("rtc", CONFIG_RTC_PORT, rtc_port_base, space_size, rtc_io_handler);
 #else
-  add_mmio_map("rtc", CONFIG_RTC_MMIO, rtc_port_base, 8, rtc_io_handler);
+  add_mmio_map("rtc", CONFIG_RTC_MMIO, rtc_port_base, space_size, rtc_io_handler);
+#endif
+  IFNDEF(CONFIG_TARGET_AM, boot_wall_time = MUXDEF(CONFIG_RTC_VIRTUAL, CONFIG_RTC_VIRTUAL_EPOCH, time(NULL)));
+#ifdef CONFIG_RTC_CACHED
+  rtc_sample();
+  event_add("rtc", EVENT_HOST, RTC_SAMPLE_PERIOD, RTC_SAMPLE_PERIOD, rtc_sample);
+#endif
+#if !defined(CONFIG_TARGET_AM) && !defined(CONFIG_HAS_CLINT)
+  add_alarm_handle(timer_intr);
 #endif
-  IFNDEF(CONFIG_TARGET_AM, add_alarm_handle(timer_intr));
 }
@@ -14,7 +14,10 @@
 ***************************************************************************************/
 
 #include <common.h>
+#include <utils.h>
 #include <device/map.h>
+#include <device/alarm.h>
+#include <device/event.h>
 
 #define SCREEN_W (MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400))
 #define SCREEN_H (MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300))
@@ -71,22 +74,75 @@ static inline void update_screen() {
 #endif
 #endif
 
+#ifdef CONFIG_VGA_SHM
+#include <device/vga-shm.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static VGAShmHeader *shm_header = NULL;
+static char name[64];
+
+static void exit_shm() {
+  shm_unlink(name);
+}
+
+static void* init_shm() {
+  // The pid is a part of the name, so that each NEMU creates its own object,
+  // and never opens the one left by another.
+  snprintf(name, sizeof(name), "%s-%d", CONFIG_VGA_SHM_NAME, getpid());
+  size_t size = VGA_SHM_HEADER_SIZE + screen_size();
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  Assert(fd >= 0, "Can not open shared memory %s", name);
+  int ret = ftruncate(fd, size);
+  Assert(ret == 0, "Can not resize shared memory %s", name);
+  uint8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  Assert(p != MAP_FAILED, "Can not mmap shared memory %s", name);
+  close(fd);
+  atexit(exit_shm);
+
+  shm_header = (VGAShmHeader *)p;
+  memset(shm_header, 0, sizeof(*shm_header));
+  shm_header->width = screen_width();
+  shm_header->height = screen_height();
+  __atomic_store_n(&shm_header->magic, VGA_SHM_MAGIC, __ATOMIC_RELEASE);
+  Log("Frame buffer is exported as shared memory %s", name);
+  return p + VGA_SHM_HEADER_SIZE;
+}
+
+static void publish_frame() {
+  extern uint64_t g_nr_guest_inst;
+  uint32_t seq = shm_header->seq;
+  __atomic_store_n(&shm_header->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  shm_header->frame ++;
+  shm_header->sync_inst = g_nr_guest_inst;
+  shm_header->sync_us = get_time();
+  __atomic_store_n(&shm_header->seq, seq + 2, __ATOMIC_RELEASE);
+}
+#endif
+
 void vga_update_screen() {
-  // TODO: call `update_screen()` when the sync register is non-zero,
-  // then zero out the sync register
+  if (vgactl_port_base[1]) {
+    IFDEF(CONFIG_VGA_SHOW_SCREEN, update_screen());
+    IFDEF(CONFIG_VGA_SHM, publish_frame());
+    vgactl_port_base[1] = 0;
+  }
 }
 
 void init_vga() {
   vgactl_port_base = (uint32_t *)new_space(8);
   vgactl_port_base[0] = (screen_width() << 16) | screen_height();
+  vgactl_port_base[1] = 0; // sync register
 #ifdef CONFIG_HAS_PORT_IO
   add_pio_map ("vgactl", CONFIG_VGA_CTL_PORT, vgactl_port_base, 8, NULL);
 #else
   add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, 8, NULL);
 #endif
 
-  vmem = new_space(screen_size());
+  vmem = MUXDEF(CONFIG_VGA_SHM, init_shm(), new_space(screen_size()));
   add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
   IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
   IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+  event_add("vsync", EVENT_HOST, 0, 1000000 / TIMER_HZ, vga_update_screen);
 }
@@ -0,0 +1,139 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <device/intr.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SECTOR_SIZE 512
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_ID_BYTES 20
+
+enum { VIRTIO_BLK_T_IN = 0, VIRTIO_BLK_T_OUT = 1, VIRTIO_BLK_T_FLUSH = 4, VIRTIO_BLK_T_GET_ID = 8 };
+enum { VIRTIO_BLK_S_OK, VIRTIO_BLK_S_IOERR, VIRTIO_BLK_S_UNSUPP };
+
+typedef struct {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} VirtioBlkReq;
+
+static uint8_t *img = NULL;
+static uint64_t img_size = 0;
+static VirtqElem elem;
+
+// Handle a whole request, and return the number of bytes written into the guest.
+static uint32_t virtio_blk_request(VirtqElem *e) {
+  VirtioBlkReq req = *(VirtioBlkReq *)virtio_guest_ptr(e->buf[0].addr, sizeof(req));
+  // bound the sector first, so that the offset does not overflow
+  uint64_t offset = (req.sector <= img_size / SECTOR_SIZE ? req.sector * SECTOR_SIZE : img_size + 1);
+  uint32_t written = 0;
+  uint8_t status = VIRTIO_BLK_S_OK;
+  int i;
+
+  switch (req.type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+      for (i = 1; i < e->nr_buf - 1; i ++) {
+        VirtqBuf *b = &e->buf[i];
+        // the data of IN is written by the device, and the data of OUT is not
+        if (offset + b->len > img_size || b->write != (req.type == VIRTIO_BLK_T_IN)) {
+          status = VIRTIO_BLK_S_IOERR;
+          break;
+        }
+        if (req.type == VIRTIO_BLK_T_IN) {
+          virtio_guest_write(b->addr, img + offset, b->len);
+          written += b->len;
+        } else {
+          memcpy(img + offset, virtio_guest_ptr(b->addr, b->len), b->len);
+        }
+        offset += b->len;
+      }
+      break;
+    case VIRTIO_BLK_T_FLUSH:
+      if (img != NULL && msync(img, img_size, MS_SYNC) != 0) status = VIRTIO_BLK_S_IOERR;
+      break;
+    case VIRTIO_BLK_T_GET_ID: {
+      char id[VIRTIO_BLK_ID_BYTES] = "nemu-virtio-blk";
+      uint32_t len = (e->nr_buf > 2 && e->buf[1].len < sizeof(id) ? e->buf[1].len : sizeof(id));
+      if (e->nr_buf > 2 && !e->buf[1].write) status = VIRTIO_BLK_S_IOERR;
+      else if (e->nr_buf > 2) { virtio_guest_write(e->buf[1].addr, id, len); written += len; }
+      break;
+    }
+    default: status = VIRTIO_BLK_S_UNSUPP; break;
+  }
+
+  virtio_guest_write(e->buf[e->nr_buf - 1].addr, &status, 1);
+  return written + 1;
+}
+
+static void virtio_blk_notify(VirtioDev *dev, int q) {
+  int nr_req = 0;
+  while (virtq_pop(dev, q, &elem)) {
+    // the header is read by the device, and the status is written by it
+    if (elem.nr_buf < 2 || elem.buf[0].len < sizeof(VirtioBlkReq) || elem.buf[0].write ||
+        !elem.buf[elem.nr_buf - 1].write || elem.buf[elem.nr_buf - 1].len < 1) {
+      virtio_fail(dev, "malformed request");
+      break;
+    }
+    uint32_t len = virtio_blk_request(&elem);
+    virtq_push(dev, q, &elem, len);
+    nr_req ++;
+  }
+  if (nr_req > 0) virtio_notify(dev);
+}
+
+static VirtioDev virtio_blk = {
+  .name = "virtio-blk",
+  .device_id = VIRTIO_ID_BLOCK,
+  .irq = IRQ_VIRTIO_BLK,
+  .features = 1ull << VIRTIO_BLK_F_FLUSH,
+  .nr_queue = 1,
+  .notify = virtio_blk_notify,
+  .config_size = sizeof(uint64_t), // capacity in sectors
+};
+
+static void virtio_blk_io_handler(uint32_t offset, int len, bool is_write) {
+  virtio_mmio_access(&virtio_blk, offset, len, is_write);
+}
+
+static void init_virtio_blk_img() {
+  const char *path = CONFIG_VIRTIO_BLK_IMG_PATH;
+  if (path[0] == '\0') return;
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) { Log("Can not open virtio-blk image: %s", path); return; }
+  struct stat st;
+  int ret = fstat(fd, &st);
+  Assert(ret == 0, "Can not stat virtio-blk image: %s", path);
+
+  img_size = st.st_size / SECTOR_SIZE * SECTOR_SIZE;
+  if (img_size > 0) {
+    img = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    Assert(img != MAP_FAILED, "Can not mmap virtio-blk image: %s", path);
+  }
+  close(fd);
+  Log("virtio-blk image is %s, sectors = %" PRIu64, path, img_size / SECTOR_SIZE);
+}
+
+void init_virtio_blk() {
+  virtio_mmio_init(&virtio_blk, CONFIG_VIRTIO_BLK_MMIO, virtio_blk_io_handler);
+  init_virtio_blk_img();
+  uint64_t capacity = img_size / SECTOR_SIZE;
+  memcpy(virtio_blk.config, &capacity, sizeof(capacity));
+}
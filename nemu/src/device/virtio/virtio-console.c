@@ -0,0 +1,104 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <device/intr.h>
+#include <device/alarm.h>
+#include <device/event.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+enum { RECEIVEQ, TRANSMITQ, NR_QUEUE };
+
+static VirtqElem elem;
+static int input_fd = -1;
+// input which is read from the host but not yet delivered to the guest
+static uint8_t rx_buf[4096];
+static uint32_t rx_len = 0, rx_pos = 0;
+
+static void virtio_console_tx(VirtioDev *dev) {
+  int nr_req = 0;
+  while (virtq_pop(dev, TRANSMITQ, &elem)) {
+    int i;
+    for (i = 0; i < elem.nr_buf; i ++) {
+      VirtqBuf *b = &elem.buf[i];
+      if (b->write) continue;
+      __attribute__((unused)) size_t ret = fwrite(virtio_guest_ptr(b->addr, b->len), 1, b->len, stderr);
+    }
+    virtq_push(dev, TRANSMITQ, &elem, 0);
+    nr_req ++;
+  }
+  if (nr_req > 0) virtio_notify(dev);
+}
+
+static void virtio_console_rx(VirtioDev *dev) {
+  int nr_req = 0;
+  while (true) {
+    if (rx_pos == rx_len) {
+      ssize_t n = (input_fd >= 0 ? read(input_fd, rx_buf, sizeof(rx_buf)) : 0);
+      rx_pos = 0;
+      rx_len = (n > 0 ? n : 0);
+      if (rx_len == 0) break;
+    }
+    if (!virtq_pop(dev, RECEIVEQ, &elem)) break;
+
+    uint32_t written = 0;
+    int i;
+    for (i = 0; i < elem.nr_buf && rx_pos < rx_len; i ++) {
+      VirtqBuf *b = &elem.buf[i];
+      if (!b->write) continue;
+      uint32_t len = (rx_len - rx_pos < b->len ? rx_len - rx_pos : b->len);
+      virtio_guest_write(b->addr, rx_buf + rx_pos, len);
+      rx_pos += len;
+      written += len;
+    }
+    virtq_push(dev, RECEIVEQ, &elem, written);
+    nr_req ++;
+  }
+  if (nr_req > 0) virtio_notify(dev);
+}
+
+static void virtio_console_notify(VirtioDev *dev, int q) {
+  if (q == TRANSMITQ) virtio_console_tx(dev);
+  else virtio_console_rx(dev); // new buffers are available for pending input
+}
+
+static VirtioDev virtio_console = {
+  .name = "virtio-console",
+  .device_id = VIRTIO_ID_CONSOLE,
+  .irq = IRQ_VIRTIO_CONSOLE,
+  .features = 0,
+  .nr_queue = NR_QUEUE,
+  .notify = virtio_console_notify,
+  .config_size = 0,
+};
+
+static void virtio_console_io_handler(uint32_t offset, int len, bool is_write) {
+  virtio_mmio_access(&virtio_console, offset, len, is_write);
+}
+
+static void virtio_console_poll() {
+  virtio_console_rx(&virtio_console);
+}
+
+void init_virtio_console() {
+  virtio_mmio_init(&virtio_console, CONFIG_VIRTIO_CONSOLE_MMIO, virtio_console_io_handler);
+
+  const char *path = CONFIG_VIRTIO_CONSOLE_INPUT_PATH;
+  if (path[0] == '\0') return;
+  input_fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (input_fd < 0) { Log("Can not open virtio-console input: %s", path); return; }
+  event_add("virtio-console", EVENT_HOST, 0, 1000000 / TIMER_HZ, virtio_console_poll);
+}
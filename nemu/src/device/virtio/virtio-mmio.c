@@ -0,0 +1,214 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <memory/paddr.h>
+#include <device/intr.h>
+#include <cpu/replay.h>
+
+#define VIRTIO_MMIO_MAGIC 0x74726976 // "virt"
+#define VIRTIO_MMIO_VENDOR 0x554d454e // "NEMU"
+
+enum {
+  MMIO_MAGIC_VALUE = 0x000, MMIO_VERSION = 0x004, MMIO_DEVICE_ID = 0x008, MMIO_VENDOR_ID = 0x00c,
+  MMIO_DEVICE_FEATURES = 0x010, MMIO_DEVICE_FEATURES_SEL = 0x014,
+  MMIO_DRIVER_FEATURES = 0x020, MMIO_DRIVER_FEATURES_SEL = 0x024,
+  MMIO_QUEUE_SEL = 0x030, MMIO_QUEUE_NUM_MAX = 0x034, MMIO_QUEUE_NUM = 0x038,
+  MMIO_QUEUE_READY = 0x044, MMIO_QUEUE_NOTIFY = 0x050,
+  MMIO_INTERRUPT_STATUS = 0x060, MMIO_INTERRUPT_ACK = 0x064, MMIO_STATUS = 0x070,
+  MMIO_QUEUE_DESC_LOW = 0x080, MMIO_QUEUE_DESC_HIGH = 0x084,
+  MMIO_QUEUE_DRIVER_LOW = 0x090, MMIO_QUEUE_DRIVER_HIGH = 0x094,
+  MMIO_QUEUE_DEVICE_LOW = 0x0a0, MMIO_QUEUE_DEVICE_HIGH = 0x0a4,
+  MMIO_CONFIG_GENERATION = 0x0fc, MMIO_CONFIG = 0x100,
+};
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} VirtqDesc;
+
+uint8_t* virtio_guest_ptr(paddr_t addr, uint32_t len) {
+  Assert(len == 0 || (in_pmem(addr) && in_pmem(addr + len - 1)),
+      "virtio buffer [" FMT_PADDR ", " FMT_PADDR "] is out of bound of pmem", addr, addr + len - 1);
+  return guest_to_host(addr);
+}
+
+void virtio_guest_write(paddr_t addr, const void *buf, uint32_t len) {
+  // the data of the device may be different, so it is taken from the log
+  IFDEF(CONFIG_REPLAY, if (replay_dma_from_log()) return);
+  memcpy(virtio_guest_ptr(addr, len), buf, len);
+  // the reference design does not know about the device
+  IFDEF(CONFIG_DIFFTEST, ref_difftest_memcpy(addr, guest_to_host(addr), len, DIFFTEST_TO_REF));
+  IFDEF(CONFIG_REPLAY, replay_record_dma(addr, len));
+}
+
+// The addresses from the driver are 64-bit, so the bits above paddr_t are
+// also checked, otherwise they would alias into pmem.
+static bool guest_range_ok(uint64_t addr, uint64_t len) {
+  if (len == 0) return true;
+  uint64_t end = addr + len - 1;
+  return end >= addr && (paddr_t)end == end && in_pmem(addr) && in_pmem(end);
+}
+
+bool virtq_pop(VirtioDev *dev, int q, VirtqElem *elem) {
+  VirtQueue *vq = &dev->vq[q];
+  if (!vq->ready || (dev->status & VIRTIO_STATUS_NEEDS_RESET)) return false;
+  if (vq->num == 0 || !guest_range_ok(vq->desc, sizeof(VirtqDesc) * vq->num) ||
+      !guest_range_ok(vq->avail, 4 + 2 * vq->num) || !guest_range_ok(vq->used, 4 + 8 * vq->num)) {
+    virtio_fail(dev, "the virtqueue is out of bound of pmem");
+    return false;
+  }
+  uint16_t *avail = (uint16_t *)virtio_guest_ptr(vq->avail, 4 + 2 * vq->num);
+  if (vq->last_avail_idx == avail[1]) return false;
+
+  uint16_t idx = avail[2 + vq->last_avail_idx % vq->num];
+  vq->last_avail_idx ++;
+  elem->head = idx;
+  elem->nr_buf = 0;
+  VirtqDesc *desc;
+  do {
+    if (idx >= vq->num || elem->nr_buf >= vq->num) {
+      virtio_fail(dev, "broken descriptor chain");
+      return false;
+    }
+    desc = (VirtqDesc *)virtio_guest_ptr(vq->desc + idx * sizeof(VirtqDesc), sizeof(VirtqDesc));
+    if (!guest_range_ok(desc->addr, desc->len)) {
+      virtio_fail(dev, "the buffer is out of bound of pmem");
+      return false;
+    }
+    VirtqBuf *b = &elem->buf[elem->nr_buf ++];
+    b->addr = desc->addr;
+    b->len = desc->len;
+    b->write = (desc->flags & VIRTQ_DESC_F_WRITE) != 0;
+    idx = desc->next;
+  } while (desc->flags & VIRTQ_DESC_F_NEXT);
+  return true;
+}
+
+void virtq_push(VirtioDev *dev, int q, VirtqElem *elem, uint32_t len) {
+  VirtQueue *vq = &dev->vq[q];
+  uint16_t *used = (uint16_t *)virtio_guest_ptr(vq->used, 4 + 8 * vq->num);
+  uint16_t used_idx = used[1];
+  uint32_t entry[2] = { elem->head, len };
+  virtio_guest_write(vq->used + 4 + 8 * (used_idx % vq->num), entry, sizeof(entry));
+  used_idx ++;
+  // publish the entry after it is written
+  virtio_guest_write(vq->used + 2, &used_idx, sizeof(used_idx));
+}
+
+void virtio_notify(VirtioDev *dev) {
+  dev->intr_status |= 1; // used buffer notification
+  dev_set_irq(dev->irq, true);
+}
+
+void virtio_fail(VirtioDev *dev, const char *reason) {
+  if (!(dev->status & VIRTIO_STATUS_NEEDS_RESET)) Log("%s: %s, the device needs reset", dev->name, reason);
+  dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+  dev->intr_status |= 2; // configuration change notification
+  dev_set_irq(dev->irq, true);
+}
+
+static void virtio_reset(VirtioDev *dev) {
+  dev->status = 0;
+  dev->device_features_sel = dev->driver_features_sel = 0;
+  dev->driver_features = 0;
+  dev->queue_sel = 0;
+  dev->intr_status = 0;
+  dev_set_irq(dev->irq, false);
+  memset(dev->vq, 0, sizeof(dev->vq));
+}
+
+static void set_half(uint64_t *p, bool high, uint32_t val) {
+  if (high) *p = (*p & 0xffffffffull) | ((uint64_t)val << 32);
+  else *p = (*p & ~0xffffffffull) | val;
+}
+
+void virtio_mmio_access(VirtioDev *dev, uint32_t offset, int len, bool is_write) {
+  if (offset >= MMIO_CONFIG) return; // the config space is accessed directly
+  assert(len == 4);
+  uint32_t *reg = &dev->base[offset / 4];
+  VirtQueue *vq = (dev->queue_sel < dev->nr_queue ? &dev->vq[dev->queue_sel] : NULL);
+  uint64_t features = dev->features | (1ull << VIRTIO_F_VERSION_1);
+
+  if (!is_write) {
+    switch (offset) {
+      case MMIO_MAGIC_VALUE: *reg = VIRTIO_MMIO_MAGIC; break;
+      case MMIO_VERSION: *reg = 2; break;
+      case MMIO_DEVICE_ID: *reg = dev->device_id; break;
+      case MMIO_VENDOR_ID: *reg = VIRTIO_MMIO_VENDOR; break;
+      case MMIO_DEVICE_FEATURES:
+        *reg = (dev->device_features_sel < 2 ? features >> (32 * dev->device_features_sel) : 0);
+        break;
+      case MMIO_QUEUE_NUM_MAX: *reg = (vq ? VIRTQ_MAX_SIZE : 0); break;
+      case MMIO_QUEUE_READY: *reg = (vq ? vq->ready : 0); break;
+      case MMIO_INTERRUPT_STATUS: *reg = dev->intr_status; break;
+      case MMIO_STATUS: *reg = dev->status; break;
+      case MMIO_CONFIG_GENERATION: *reg = 0; break;
+      default: *reg = 0; break;
+    }
+    return;
+  }
+
+  uint32_t val = *reg;
+  switch (offset) {
+    case MMIO_DEVICE_FEATURES_SEL: dev->device_features_sel = val; break;
+    case MMIO_DRIVER_FEATURES:
+      if (dev->driver_features_sel < 2) set_half(&dev->driver_features, dev->driver_features_sel, val);
+      break;
+    case MMIO_DRIVER_FEATURES_SEL: dev->driver_features_sel = val; break;
+    case MMIO_QUEUE_SEL: dev->queue_sel = val; break;
+    case MMIO_QUEUE_NUM:
+      if (vq == NULL) break;
+      if (val > 0 && val <= VIRTQ_MAX_SIZE) vq->num = val;
+      else virtio_fail(dev, "invalid queue size");
+      break;
+    case MMIO_QUEUE_READY:
+      if (vq) { vq->ready = (val & 1); vq->last_avail_idx = 0; }
+      break;
+    case MMIO_QUEUE_NOTIFY:
+      if (val < dev->nr_queue && dev->vq[val].ready) dev->notify(dev, val);
+      break;
+    case MMIO_INTERRUPT_ACK:
+      dev->intr_status &= ~val;
+      dev_set_irq(dev->irq, dev->intr_status != 0);
+      break;
+    case MMIO_STATUS:
+      if (val == 0) virtio_reset(dev);
+      else dev->status = val | (dev->status & VIRTIO_STATUS_NEEDS_RESET);
+      break;
+    case MMIO_QUEUE_DESC_LOW:    case MMIO_QUEUE_DESC_HIGH:
+      if (vq) set_half(&vq->desc, offset == MMIO_QUEUE_DESC_HIGH, val);
+      break;
+    case MMIO_QUEUE_DRIVER_LOW:  case MMIO_QUEUE_DRIVER_HIGH:
+      if (vq) set_half(&vq->avail, offset == MMIO_QUEUE_DRIVER_HIGH, val);
+      break;
+    case MMIO_QUEUE_DEVICE_LOW:  case MMIO_QUEUE_DEVICE_HIGH:
+      if (vq) set_half(&vq->used, offset == MMIO_QUEUE_DEVICE_HIGH, val);
+      break;
+    default: break; // read-only or unknown registers
+  }
+}
+
+void virtio_mmio_init(VirtioDev *dev, paddr_t addr, io_callback_t callback) {
+  Assert(dev->nr_queue <= VIRTIO_MAX_QUEUE, "%s: too many queues", dev->name);
+  Assert(dev->config_size <= VIRTIO_MMIO_SIZE - MMIO_CONFIG, "%s: config space is too large", dev->name);
+  dev->base = (uint32_t *)new_space(VIRTIO_MMIO_SIZE);
+  memset(dev->base, 0, VIRTIO_MMIO_SIZE);
+  dev->config = (uint8_t *)dev->base + MMIO_CONFIG;
+  virtio_reset(dev);
+  add_mmio_map(dev->name, addr, dev->base, VIRTIO_MMIO_SIZE, callback);
+}
@@ -20,6 +20,8 @@
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret) {
   difftest_skip_ref();
+  // difftest may find a mismatch before this instruction
+  if (nemu_state.state == NEMU_ABORT) return;
   nemu_state.state = state;
   nemu_state.halt_pc = pc;
   nemu_state.halt_ret = halt_ret;
@@ -23,3 +23,17 @@ bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
 
 void isa_difftest_attach() {
 }
+
+int isa_difftest_dest_reg(ISADecodeInfo *s) {
+  uint32_t inst = s->inst.val;
+  uint32_t op6 = BITS(inst, 31, 26), op10 = BITS(inst, 31, 22);
+  int rd = BITS(inst, 4, 0);
+  if (op6 == 0x15) return 1; // bl
+  // b, branches and stores have no rd
+  if (op6 == 0x14 || (op6 >= 0x16 && op6 <= 0x1b) || (op10 >= 0x0a4 && op10 <= 0x0a6)) return -1;
+  return (rd == 0 ? -1 : rd);
+}
+
+const char* isa_difftest_reg_name(int idx) {
+  return (idx < ARRLEN(cpu.gpr) ? reg_name(idx) : "pc");
+}
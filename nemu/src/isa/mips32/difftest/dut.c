@@ -23,3 +23,44 @@ bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
 
 void isa_difftest_attach() {
 }
+
+// index of lo and hi in CPU_state, see isa_difftest_reg_name()
+#define REG_LO 33
+#define REG_HI 34
+
+// Only lo is reported for the instructions writing both lo and hi.
+static int special_dest_reg(uint32_t inst) {
+  switch (BITS(inst, 5, 0)) {
+    case 0x11: return REG_HI; // mthi
+    case 0x13: return REG_LO; // mtlo
+    case 0x18 ... 0x1b: return REG_LO; // mult, multu, div, divu
+    default: return BITS(inst, 15, 11);
+  }
+}
+
+int isa_difftest_dest_reg(ISADecodeInfo *s) {
+  uint32_t inst = s->inst.val;
+  uint32_t opcode = BITS(inst, 31, 26);
+  int r;
+  switch (opcode) {
+    case 0x00: r = special_dest_reg(inst); break; // SPECIAL
+    case 0x01: r = ((BITS(inst, 20, 16) & 0x1e) == 0x10 ? 31 : 0); break; // bltzal, bgezal
+    case 0x03: r = 31; break; // jal
+    case 0x10: r = (BITS(inst, 25, 21) == 0x00 ? BITS(inst, 20, 16) : 0); break; // mfc0
+    case 0x1c: // SPECIAL2: mul, clz and clo write rd, the others write lo and hi
+      switch (BITS(inst, 5, 0)) {
+        case 0x02: case 0x20: case 0x21: r = BITS(inst, 15, 11); break;
+        default: r = REG_LO; break;
+      }
+      break;
+    case 0x02: case 0x04 ... 0x07: r = 0; break; // jumps and branches
+    case 0x28 ... 0x2e: r = 0; break; // stores
+    default: r = BITS(inst, 20, 16); break;
+  }
+  return (r == 0 ? -1 : r);
+}
+
+const char* isa_difftest_reg_name(int idx) {
+  static const char *others[] = { "status", "lo", "hi", "badvaddr", "cause", "pc" };
+  return (idx < ARRLEN(cpu.gpr) ? reg_name(idx) : others[idx - ARRLEN(cpu.gpr)]);
+}
@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <device/intr.h>
 
 word_t isa_raise_intr(word_t NO, vaddr_t epc) {
   /* TODO: Trigger an interrupt/exception with ``NO''.
@@ -24,5 +25,8 @@ word_t isa_raise_intr(word_t NO, vaddr_t epc) {
 }
 
 word_t isa_query_intr() {
+  // the periodic tick of the timer device is dropped if it is not taken,
+  // or the CPU loop queries it after every instruction
+  IFDEF(CONFIG_DEVICE, intr_set_line(INTR_LINE_TIMER, false));
   return INTR_EMPTY;
 }
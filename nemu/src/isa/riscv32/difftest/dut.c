@@ -18,8 +18,26 @@
 #include "../local-include/reg.h"
 
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
-  return false;
+  bool ok = true;
+  int i;
+  for (i = 0; i < ARRLEN(cpu.gpr); i ++) {
+    ok &= difftest_check_reg(reg_name(i), pc, ref_r->gpr[i], gpr(i));
+  }
+  ok &= difftest_check_reg("pc", pc, ref_r->pc, cpu.pc);
+  return ok;
 }
 
 void isa_difftest_attach() {
 }
+
+int isa_difftest_dest_reg(ISADecodeInfo *s) {
+  uint32_t opcode = BITS(s->inst.val, 6, 0);
+  int rd = BITS(s->inst.val, 11, 7);
+  // stores and branches have no rd
+  if (opcode == 0x23 || opcode == 0x63 || rd == 0) return -1;
+  return rd;
+}
+
+const char* isa_difftest_reg_name(int idx) {
+  return (idx < ARRLEN(cpu.gpr) ? reg_name(idx) : "pc");
+}
@@ -21,6 +21,11 @@
 typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
+  // Only the machine mode CSRs for traps are kept. They are placed after
+  // pc, so they are not part of the registers copied by difftest.
+  struct {
+    word_t mstatus, mie, mtvec, mscratch, mepc, mcause;
+  } csr;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -24,6 +24,7 @@
 
 enum {
   TYPE_I, TYPE_U, TYPE_S,
+  TYPE_Z, // CSR instructions with the immediate in rs1
   TYPE_N, // none
 };
 
@@ -42,9 +43,18 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
     case TYPE_I: src1R();          immI(); break;
     case TYPE_U:                   immU(); break;
     case TYPE_S: src1R(); src2R(); immS(); break;
+    case TYPE_Z: *src1 = rs1;      immI(); break;
   }
 }
 
+static vaddr_t mret() {
+  word_t mstatus = cpu.csr.mstatus;
+  mstatus = (mstatus & ~MSTATUS_MIE) | ((mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+  cpu.csr.mstatus = mstatus | MSTATUS_MPIE;
+  csr_intr_update();
+  return cpu.csr.mepc;
+}
+
 static int decode_exec(Decode *s) {
   int rd = 0;
   word_t src1 = 0, src2 = 0, imm = 0;
@@ -61,6 +71,14 @@ static int decode_exec(Decode *s) {
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
   INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
 
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw  , I, word_t t = csr_read(imm & 0xfff); csr_write(imm & 0xfff, src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs  , I, word_t t = csr_read(imm & 0xfff); if (src1) csr_write(imm & 0xfff, t | src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 011 ????? 11100 11", csrrc  , I, word_t t = csr_read(imm & 0xfff); if (src1) csr_write(imm & 0xfff, t & ~src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 101 ????? 11100 11", csrrwi , Z, word_t t = csr_read(imm & 0xfff); csr_write(imm & 0xfff, src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 110 ????? 11100 11", csrrsi , Z, word_t t = csr_read(imm & 0xfff); if (src1) csr_write(imm & 0xfff, t | src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 111 ????? 11100 11", csrrci , Z, word_t t = csr_read(imm & 0xfff); if (src1) csr_write(imm & 0xfff, t & ~src1); R(rd) = t);
+  INSTPAT("0011000 00010 00000 000 00000 11100 11", mret   , N, s->dnpc = mret());
+
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
   INSTPAT_END();
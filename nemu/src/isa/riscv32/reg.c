@@ -29,3 +29,39 @@ void isa_reg_display() {
 word_t isa_reg_str2val(const char *s, bool *success) {
   return 0;
 }
+
+// The other CSRs, such as satp written by AM, are not implemented. They
+// read 0 and ignore writes, with a warning at the first access to each.
+static void csr_unsupported(uint32_t addr) {
+  static bool warned[4096] = {};
+  if (warned[addr]) return;
+  warned[addr] = true;
+  Log("unsupported CSR = 0x%x at pc = " FMT_WORD " reads 0 and ignores writes", addr, cpu.pc);
+}
+
+word_t csr_read(uint32_t addr) {
+  switch (addr) {
+    case CSR_MSTATUS:  return cpu.csr.mstatus;
+    case CSR_MIE:      return cpu.csr.mie;
+    case CSR_MTVEC:    return cpu.csr.mtvec;
+    case CSR_MSCRATCH: return cpu.csr.mscratch;
+    case CSR_MEPC:     return cpu.csr.mepc;
+    case CSR_MCAUSE:   return cpu.csr.mcause;
+    case CSR_MIP:      return csr_mip();
+    case CSR_MHARTID:  return 0;
+    default: csr_unsupported(addr); return 0;
+  }
+}
+
+void csr_write(uint32_t addr, word_t val) {
+  switch (addr) {
+    case CSR_MSTATUS:  cpu.csr.mstatus = val; csr_intr_update(); break;
+    case CSR_MIE:      cpu.csr.mie = val & (MIP_MSIP | MIP_MTIP | MIP_MEIP); csr_intr_update(); break;
+    case CSR_MTVEC:    cpu.csr.mtvec = val; break;
+    case CSR_MSCRATCH: cpu.csr.mscratch = val; break;
+    case CSR_MEPC:     cpu.csr.mepc = val & ~(word_t)3; break;
+    case CSR_MCAUSE:   cpu.csr.mcause = val; break;
+    case CSR_MIP: case CSR_MHARTID: break; // driven by the platform
+    default: csr_unsupported(addr); break;
+  }
+}
@@ -14,15 +14,68 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <device/intr.h>
+#include "../local-include/reg.h"
+
+#define INTR_BIT ((word_t)1 << (sizeof(word_t) * 8 - 1))
+enum { IRQ_MSI = 3, IRQ_MTI = 7, IRQ_MEI = 11 };
+
+#if defined(CONFIG_DEVICE) && !defined(CONFIG_HAS_CLINT)
+// The periodic tick of the timer device is not acknowledged by the guest.
+// While it is disabled, the tick is kept pending here instead of on the
+// line, so that the CPU loop does not query it after every instruction.
+#define TIMER_TICK 1
+static bool tick_pending = false;
+#endif
+
+static inline bool intr_enabled(word_t mip) {
+  return (cpu.csr.mstatus & MSTATUS_MIE) && (cpu.csr.mie & mip);
+}
+
+word_t csr_mip() {
+  uint32_t lines = MUXDEF(CONFIG_DEVICE, g_intr_lines, 0);
+  IFDEF(TIMER_TICK, if (tick_pending) lines |= INTR_LINE_TIMER);
+  return ((lines & INTR_LINE_SOFT)  ? MIP_MSIP : 0) |
+         ((lines & INTR_LINE_TIMER) ? MIP_MTIP : 0) |
+         ((lines & INTR_LINE_EXT)   ? MIP_MEIP : 0);
+}
+
+// Called after the guest may enable interrupts.
+void csr_intr_update() {
+#ifdef TIMER_TICK
+  if (tick_pending && intr_enabled(MIP_MTIP)) {
+    tick_pending = false;
+    intr_set_line(INTR_LINE_TIMER, true);
+  }
+#endif
+}
 
 word_t isa_raise_intr(word_t NO, vaddr_t epc) {
-  /* TODO: Trigger an interrupt/exception with ``NO''.
-   * Then return the address of the interrupt/exception vector.
-   */
+  cpu.csr.mepc = epc;
+  cpu.csr.mcause = NO;
+  word_t mstatus = cpu.csr.mstatus;
+  mstatus = (mstatus & ~MSTATUS_MPIE) | ((mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0);
+  mstatus = (mstatus & ~MSTATUS_MIE) | MSTATUS_MPP;
+  cpu.csr.mstatus = mstatus;
 
-  return 0;
+  word_t base = cpu.csr.mtvec & ~(word_t)3;
+  bool vectored = (cpu.csr.mtvec & 3) == 1 && (NO & INTR_BIT);
+  return base + (vectored ? 4 * (NO & ~INTR_BIT) : 0);
 }
 
 word_t isa_query_intr() {
-  return INTR_EMPTY;
+#ifdef TIMER_TICK
+  if ((g_intr_lines & INTR_LINE_TIMER) && !intr_enabled(MIP_MTIP)) {
+    tick_pending = true;
+    intr_set_line(INTR_LINE_TIMER, false);
+  }
+#endif
+  if (!(cpu.csr.mstatus & MSTATUS_MIE)) return INTR_EMPTY;
+  word_t pending = csr_mip() & cpu.csr.mie;
+  if (pending == 0) return INTR_EMPTY;
+  // the priority is MEI > MSI > MTI
+  int irq = (pending & MIP_MEIP) ? IRQ_MEI : (pending & MIP_MSIP) ? IRQ_MSI : IRQ_MTI;
+  // the tick is taken
+  IFDEF(TIMER_TICK, if (irq == IRQ_MTI) intr_set_line(INTR_LINE_TIMER, false));
+  return INTR_BIT | irq;
 }
@@ -15,6 +15,7 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <cpu/difftest.h>
 #include <device/mmio.h>
 #include <isa.h>
 
@@ -33,6 +34,10 @@ static word_t pmem_read(paddr_t addr, int len) {
 }
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_DIFFTEST_BATCH, difftest_log_store(addr, len));
+  IFDEF(CONFIG_DIFFTEST_MEMHASH, difftest_mark_dirty(addr, len));
+  IFDEF(CONFIG_DIFFTEST_THREAD, difftest_record_store(addr, len, data));
+  IFDEF(CONFIG_DIFFTEST_HISTORY, difftest_history_store(addr, len, data));
   host_write(guest_to_host(addr), len, data);
 }
 
@@ -52,6 +52,16 @@ static int cmd_q(char *args) {
   return -1;
 }
 
+#ifdef CONFIG_DEVICE_PROFILE
+void map_profile_display();
+void map_profile_start_rate();
+
+static int cmd_dev(char *args) {
+  map_profile_display();
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -62,6 +72,9 @@ static struct {
   { "help", "Display information about all supported commands", cmd_help },
   { "c", "Continue the execution of the program", cmd_c },
   { "q", "Exit NEMU", cmd_q },
+#ifdef CONFIG_DEVICE_PROFILE
+  { "dev", "Display the access profile of devices", cmd_dev },
+#endif
 
   /* TODO: Add more commands */
 
@@ -98,6 +111,7 @@ void sdb_set_batch_mode() {
 
 void sdb_mainloop() {
   if (is_batch_mode) {
+    IFDEF(CONFIG_DEVICE_PROFILE, map_profile_start_rate());
     cmd_c(NULL);
     return;
   }
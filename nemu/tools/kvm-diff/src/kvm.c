@@ -20,7 +20,11 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/mman.h>
 #include <linux/kvm.h>
 
@@ -35,6 +39,13 @@
 #define RFLAGS_AF  (1u << 4)
 #define RFLAGS_FIX_MASK (RFLAGS_ID | RFLAGS_AC | RFLAGS_RF | RFLAGS_TF | RFLAGS_AF)
 
+// running natively gives up after this, and DUT checks by single-stepping
+#define RUN_TO_TIMEOUT_MS 100
+#define RUN_TO_SIG SIGRTMIN
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 struct vm {
   int sys_fd;
   int fd;
@@ -48,6 +59,7 @@ struct vcpu {
   int int_wp_state;
   int has_error_code;
   uint32_t entry;
+  timer_t timer;  // bounds running natively
 };
 
 enum {
@@ -58,6 +70,7 @@ enum {
 
 static struct vm vm;
 static struct vcpu vcpu;
+static volatile sig_atomic_t running_natively = false;
 
 // This should be called everytime after KVM_SET_REGS.
 // It seems that KVM_SET_REGS will clean the state of single step.
@@ -72,6 +85,18 @@ static void kvm_set_step_mode(bool watch, uint32_t watch_addr) {
   }
 }
 
+// Run the guest natively, and only stop at the instruction at `bp_addr`.
+static void kvm_set_run_mode(uint32_t bp_addr) {
+  struct kvm_guest_debug debug = {};
+  debug.control = KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_USE_HW_BP;
+  debug.arch.debugreg[0] = bp_addr;
+  debug.arch.debugreg[7] = 0x1;
+  if (ioctl(vcpu.fd, KVM_SET_GUEST_DEBUG, &debug) < 0) {
+    perror("KVM_SET_GUEST_DEBUG");
+    assert(0);
+  }
+}
+
 static void kvm_setregs(const struct kvm_regs *r) {
   if (ioctl(vcpu.fd, KVM_SET_REGS, r) < 0) {
     perror("KVM_SET_REGS");
@@ -153,6 +178,35 @@ static void vm_init(size_t mem_size) {
   vm.mmio = create_mem(1, 0xa1000000, 0x1000);
 }
 
+// If the signal comes before entering the guest, KVM_RUN returns EINTR
+// at once because of `immediate_exit`. A signal after running natively
+// is ignored, otherwise single-stepping would never make progress.
+static void timer_handler(int sig) {
+  if (running_natively) vcpu.kvm_run->immediate_exit = 1;
+}
+
+// The signal is sent to this thread, which is the one calling KVM_RUN.
+static void timer_init() {
+  struct sigaction sa = { .sa_handler = timer_handler };
+  sigemptyset(&sa.sa_mask);
+  // no SA_RESTART, so that KVM_RUN is interrupted
+  int ret = sigaction(RUN_TO_SIG, &sa, NULL);
+  assert(ret == 0);
+
+  struct sigevent sev = { .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = RUN_TO_SIG };
+  sev.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(CLOCK_MONOTONIC, &sev, &vcpu.timer) < 0) {
+    perror("timer_create");
+    assert(0);
+  }
+}
+
+static void timer_arm(int ms) {
+  struct itimerspec its = { .it_value = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L } };
+  int ret = timer_settime(vcpu.timer, 0, &its, NULL);
+  assert(ret == 0);
+}
+
 static void vcpu_init() {
   int vcpu_mmap_size;
 
@@ -177,6 +231,7 @@ static void vcpu_init() {
 
   vcpu.kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
   vcpu.int_wp_state = STATE_IDLE;
+  timer_init();
 }
 
 static const uint8_t mbr[] = {
@@ -327,6 +382,48 @@ static void kvm_exec(uint64_t n) {
   }
 }
 
+// Run natively until reaching `pc`. Return false if it does not reach `pc`
+// in time, or the guest exits for another reason, such as halting or
+// accessing I/O. DUT will find the difference and check by single-stepping.
+static bool kvm_run_to(uint32_t pc) {
+  bool ok = false;
+  kvm_set_run_mode(pc);
+  // TF is kept in RFLAGS for single-stepping, see difftest_regcpy()
+  vcpu.kvm_run->s.regs.regs.rflags &= ~RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  running_natively = true;
+  timer_arm(RUN_TO_TIMEOUT_MS);
+  while (true) {
+    if (ioctl(vcpu.fd, KVM_RUN, 0) < 0) {
+      if (errno != EINTR) {
+        perror("KVM_RUN");
+        assert(0);
+      }
+      if (vcpu.kvm_run->immediate_exit) break;  // timeout
+      continue;
+    }
+    if (vcpu.kvm_run->exit_reason != KVM_EXIT_DEBUG) {
+      if (vcpu.kvm_run->exit_reason != KVM_EXIT_HLT) {
+        fprintf(stderr, "Got exit_reason %d at pc = 0x%llx when running natively, give up\n",
+            vcpu.kvm_run->exit_reason, vcpu.kvm_run->s.regs.regs.rip);
+        // complete the pending I/O before the registers are set again
+        vcpu.kvm_run->immediate_exit = 1;
+        ioctl(vcpu.fd, KVM_RUN, 0);
+      }
+      break;
+    }
+    if (vcpu.kvm_run->s.regs.regs.rip == pc) { ok = true; break; }
+  }
+  running_natively = false;
+  timer_arm(0);
+  vcpu.kvm_run->immediate_exit = 0;
+
+  vcpu.kvm_run->s.regs.regs.rflags |= RFLAGS_TF;
+  vcpu.kvm_run->kvm_dirty_regs = KVM_SYNC_X86_REGS;
+  kvm_set_step_mode(false, 0);
+  return ok;
+}
+
 static void run_protected_mode() {
   struct kvm_sregs sregs;
   kvm_getsregs(&sregs);
@@ -350,6 +447,10 @@ __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction)
   else memcpy(buf, vm.mem + addr, n);
 }
 
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  return difftest_hash(vm.mem + addr, n);
+}
+
 __EXPORT void difftest_regcpy(void *r, bool direction) {
   struct kvm_regs *ref = &(vcpu.kvm_run->s.regs.regs);
   x86_CPU_state *x86 = r;
@@ -382,6 +483,26 @@ __EXPORT void difftest_exec(uint64_t n) {
   kvm_exec(n);
 }
 
+// Execute the `n` instructions which end when reaching `pc` for the
+// `nr_hit`-th time. They are run natively with a hardware breakpoint at
+// `pc`, and only the instructions at `pc` are single-stepped. Since the
+// instructions are not patched as single-stepping does, DUT should check
+// again by single-stepping if the result is different.
+__EXPORT void difftest_exec_to(uint64_t n, uint64_t pc, uint64_t nr_hit) {
+  // interrupts are handled by the watchpoint of single-stepping
+  if (vcpu.int_wp_state != STATE_IDLE) { kvm_exec(n); return; }
+  while (nr_hit > 0) {
+    if (vcpu.kvm_run->s.regs.regs.rip == pc) {
+      // the breakpoint fires before the instruction, so step over it
+      kvm_exec(1);
+      if (vcpu.kvm_run->s.regs.regs.rip == pc) nr_hit --;
+      continue;
+    }
+    if (!kvm_run_to(pc)) return;
+    nr_hit --;
+  }
+}
+
 __EXPORT void difftest_raise_intr(word_t NO) {
   uint32_t pgate_vaddr = vcpu.kvm_run->s.regs.sregs.idt.base + NO * 8;
   uint32_t pgate = va2pa(pgate_vaddr);
@@ -33,6 +33,25 @@
 #error Unsupport ISA
 #endif
 
+#if defined(CONFIG_ISA_x86)
+#define ISA_QEMU_PC eip
+#else
+#define ISA_QEMU_PC pc
+#endif
+
+// The register enabling interrupts, with the number used by gdb, and the
+// bits of it which are cleared when QEMU runs without single-stepping.
+#if defined(CONFIG_ISA_mips32)
+#define ISA_QEMU_INTR_REG 32 // status
+#define ISA_QEMU_INTR_MASK 0x1 // IE
+#elif defined(CONFIG_ISA_riscv)
+#define ISA_QEMU_INTR_REG (65 + 0x300) // mstatus, CSRs follow the GPRs, pc and the FPRs
+#define ISA_QEMU_INTR_MASK 0xa // MIE, SIE
+#elif defined(CONFIG_ISA_x86)
+#define ISA_QEMU_INTR_REG 9 // eflags
+#define ISA_QEMU_INTR_MASK 0x200 // IF
+#endif
+
 union isa_gdb_regs {
   struct {
 #if defined(CONFIG_ISA_mips32)
@@ -28,10 +28,19 @@ uint8_t hex_encode(uint8_t digit);
 
 struct gdb_conn *gdb_begin_inet(const char *addr, uint16_t port);
 
+struct gdb_conn *gdb_begin_unix(const char *path);
+
 void gdb_end(struct gdb_conn *conn);
 
 void gdb_send(struct gdb_conn *conn, const uint8_t *command, size_t size);
 
 uint8_t *gdb_recv(struct gdb_conn *conn, size_t *size);
 
+// Return whether a reply arrives within `timeout_ms`. This is only reliable
+// when all previous replies are received, so that none is buffered by stdio.
+bool gdb_wait(struct gdb_conn *conn, int timeout_ms);
+
+// Stop the running target, which then replies with a stop packet.
+void gdb_interrupt(struct gdb_conn *conn);
+
 const char * gdb_start_noack(struct gdb_conn *conn);
@@ -18,27 +18,40 @@
 #include <sys/prctl.h>
 #include <signal.h>
 
-bool gdb_connect_qemu(int);
+bool gdb_connect_qemu(const char *);
 bool gdb_memcpy_to_qemu(uint32_t, void *, int);
+bool gdb_memcpy_from_qemu(uint32_t, void *, int);
 bool gdb_getregs(union isa_gdb_regs *);
 bool gdb_setregs(union isa_gdb_regs *);
+int gdb_getreg(int, uint64_t *);
+bool gdb_setreg(int, uint64_t, int);
 bool gdb_si();
+bool gdb_set_bp(uint32_t, bool);
+bool gdb_cont(int);
 void gdb_exit();
 
 void init_isa();
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(direction == DIFFTEST_TO_REF);
-  if (direction == DIFFTEST_TO_REF) {
-    bool ok = gdb_memcpy_to_qemu(addr, buf, n);
-    assert(ok == 1);
-  }
+  bool ok;
+  if (direction == DIFFTEST_TO_REF) ok = gdb_memcpy_to_qemu(addr, buf, n);
+  else ok = gdb_memcpy_from_qemu(addr, buf, n);
+  assert(ok == 1);
 }
 
+// The registers of QEMU, which are valid until QEMU executes instructions.
+// They are also needed when copying to QEMU, since the G packet sets all
+// registers, including those not known by DUT.
+static union isa_gdb_regs qemu_r;
+static bool qemu_r_valid = false;
+
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
-  union isa_gdb_regs qemu_r;
-  gdb_getregs(&qemu_r);
+  if (!qemu_r_valid) {
+    gdb_getregs(&qemu_r);
+    qemu_r_valid = true;
+  }
   if (direction == DIFFTEST_TO_REF) {
+    if (memcmp(&qemu_r, dut, DIFFTEST_REG_SIZE) == 0) return;
     memcpy(&qemu_r, dut, DIFFTEST_REG_SIZE);
     gdb_setregs(&qemu_r);
   } else {
@@ -47,12 +60,80 @@ __EXPORT void difftest_regcpy(void *dut, bool direction) {
 }
 
 __EXPORT void difftest_exec(uint64_t n) {
+  if (n > 0) qemu_r_valid = false;
   while (n --) gdb_si();
 }
 
+static uint64_t qemu_pc() {
+  if (!qemu_r_valid) {
+    gdb_getregs(&qemu_r);
+    qemu_r_valid = true;
+  }
+  return qemu_r.ISA_QEMU_PC;
+}
+
+// QEMU runs millions of instructions per second even when translating new
+// code, so REF has gone elsewhere if the breakpoint is not hit in time.
+#define EXEC_TO_TIMEOUT_MS(n) (1000 + (n) / 1000)
+
+// Interrupts are not taken when single-stepping, but they are when QEMU runs
+// without stopping. So they are disabled during the run, and enabled again
+// after it, unless the guest writes the bits itself. Return the number of
+// bytes of the register, or 0 if it can not be accessed.
+static int intr_disable(uint64_t *saved) {
+  int width = gdb_getreg(ISA_QEMU_INTR_REG, saved);
+  if (width > 0 && (*saved & ISA_QEMU_INTR_MASK)) {
+    gdb_setreg(ISA_QEMU_INTR_REG, *saved & ~(uint64_t)ISA_QEMU_INTR_MASK, width);
+  }
+  return width;
+}
+
+static void intr_restore(uint64_t saved, int width) {
+  uint64_t val;
+  if (width == 0 || !(saved & ISA_QEMU_INTR_MASK)) return;
+  if (gdb_getreg(ISA_QEMU_INTR_REG, &val) == width && !(val & ISA_QEMU_INTR_MASK)) {
+    gdb_setreg(ISA_QEMU_INTR_REG, val | (saved & ISA_QEMU_INTR_MASK), width);
+  }
+}
+
+// Execute the `n` instructions which end when reaching `pc` for the
+// `nr_hit`-th time. They are run by QEMU without stopping, with a
+// breakpoint at `pc`, and only the instructions at `pc` are single-stepped,
+// since the breakpoint stops QEMU before them. If REF does not reach `pc`,
+// DUT finds it different, and checks again by single-stepping.
+__EXPORT void difftest_exec_to(uint64_t n, uint64_t pc, uint64_t nr_hit) {
+  bool bp = false;
+  uint64_t intr_saved = 0;
+  int intr_width = 0;
+  while (nr_hit > 0) {
+    if (qemu_pc() == pc) {
+      difftest_exec(1);
+      if (qemu_pc() == pc) nr_hit --;
+      continue;
+    }
+    if (!bp) {
+      gdb_set_bp(pc, true);
+      intr_width = intr_disable(&intr_saved);
+      bp = true;
+    }
+    qemu_r_valid = false;
+    if (!gdb_cont(EXEC_TO_TIMEOUT_MS(n))) break;
+    nr_hit --;
+  }
+  if (bp) {
+    gdb_set_bp(pc, false);
+    intr_restore(intr_saved, intr_width);
+    qemu_r_valid = false;
+  }
+}
+
 __EXPORT void difftest_init(int port) {
-  char buf[32];
-  sprintf(buf, "tcp::%d", port);
+  // QEMU is connected with a Unix socket, which has a lower latency than TCP.
+  // The port is only used to make the path unique.
+  char path[64], buf[96];
+  sprintf(path, "/tmp/nemu-qemu-%d-%d.sock", getpid(), port);
+  sprintf(buf, "unix:%s,server=on,wait=off", path);
+  unlink(path);
 
   int ppid_before_fork = getpid();
   int pid = fork();
@@ -84,8 +165,9 @@ __EXPORT void difftest_init(int port) {
   else {
     // father
 
-    gdb_connect_qemu(port);
-    printf("Connect to QEMU with %s successfully\n", buf);
+    gdb_connect_qemu(path);
+    printf("Connect to QEMU with %s successfully\n", path);
+    unlink(path);
 
     atexit(gdb_exit);
 
@@ -17,49 +17,101 @@
 
 static struct gdb_conn *conn;
 
-bool gdb_connect_qemu(int port) {
-  // connect to gdbserver on localhost port 1234
-  while ((conn = gdb_begin_inet("127.0.0.1", port)) == NULL) {
+// Packets which only change the state of a stopped QEMU (memory and register
+// writes) are sent without waiting for their replies. The replies are
+// collected before the next packet whose reply is needed. Packets which
+// resume QEMU can not be pipelined, since QEMU stops when it receives
+// anything while running.
+#define MAX_INFLIGHT 64
+static int nr_inflight = 0;
+
+static void gdb_drain() {
+  while (nr_inflight > 0) {
+    size_t size;
+    uint8_t *reply = gdb_recv(conn, &size);
+    bool ok = !strcmp((const char*)reply, "OK");
+    if (!ok) printf("QEMU replies '%s' to a write request\n", reply);
+    assert(ok);
+    free(reply);
+    nr_inflight --;
+  }
+}
+
+static void gdb_send_pipelined(const char *buf) {
+  if (nr_inflight == MAX_INFLIGHT) gdb_drain();
+  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  nr_inflight ++;
+}
+
+bool gdb_connect_qemu(const char *path) {
+  while ((conn = gdb_begin_unix(path)) == NULL) {
     usleep(1);
   }
 
+  // the transport is reliable, so skip the acknowledgement of each packet
+  gdb_start_noack(conn);
   return true;
 }
 
-static bool gdb_memcpy_to_qemu_small(uint32_t dest, void *src, int len) {
+static void gdb_memcpy_to_qemu_small(uint32_t dest, void *src, int len) {
   char *buf = malloc(len * 2 + 128);
   assert(buf != NULL);
   int p = sprintf(buf, "M0x%x,%x:", dest, len);
   int i;
   for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
+    buf[p ++] = hex_encode(((uint8_t *)src)[i] >> 4);
+    buf[p ++] = hex_encode(((uint8_t *)src)[i] & 0xf);
   }
+  buf[p] = '\0';
 
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  gdb_send_pipelined(buf);
   free(buf);
-
-  size_t size;
-  uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
-  free(reply);
-
-  return ok;
 }
 
 bool gdb_memcpy_to_qemu(uint32_t dest, void *src, int len) {
   const int mtu = 1500;
-  bool ok = true;
   while (len > mtu) {
-    ok &= gdb_memcpy_to_qemu_small(dest, src, mtu);
+    gdb_memcpy_to_qemu_small(dest, src, mtu);
     dest += mtu;
     src += mtu;
     len -= mtu;
   }
-  ok &= gdb_memcpy_to_qemu_small(dest, src, len);
+  gdb_memcpy_to_qemu_small(dest, src, len);
+  gdb_drain();
+  return true;
+}
+
+static bool gdb_memcpy_from_qemu_small(uint32_t src, void *dest, int len) {
+  char buf[32];
+  sprintf(buf, "m0x%x,%x", src, len);
+  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  size_t size;
+  uint8_t *reply = gdb_recv(conn, &size);
+  bool ok = (size == len * 2);
+  int i;
+  for (i = 0; ok && i < len; i ++) {
+    ((uint8_t *)dest)[i] = gdb_decode_hex(reply[i * 2], reply[i * 2 + 1]);
+  }
+  if (!ok) printf("QEMU replies '%s' to a read request\n", reply);
+  free(reply);
   return ok;
 }
 
+bool gdb_memcpy_from_qemu(uint32_t src, void *dest, int len) {
+  const int mtu = 1500;
+  gdb_drain();
+  while (len > 0) {
+    int n = (len > mtu ? mtu : len);
+    if (!gdb_memcpy_from_qemu_small(src, dest, n)) return false;
+    src += n;
+    dest += n;
+    len -= n;
+  }
+  return true;
+}
+
 bool gdb_getregs(union isa_gdb_regs *r) {
+  gdb_drain();
   gdb_send(conn, (const uint8_t *)"g", 1);
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
@@ -80,6 +132,7 @@ bool gdb_getregs(union isa_gdb_regs *r) {
   return true;
 }
 
+// The reply is collected before the next packet whose reply is needed.
 bool gdb_setregs(union isa_gdb_regs *r) {
   int len = sizeof(union isa_gdb_regs);
   char *buf = malloc(len * 2 + 128);
@@ -90,29 +143,85 @@ bool gdb_setregs(union isa_gdb_regs *r) {
   int p = 1;
   int i;
   for (i = 0; i < len; i ++) {
-    p += sprintf(buf + p, "%c%c", hex_encode(((uint8_t *)src)[i] >> 4), hex_encode(((uint8_t *)src)[i] & 0xf));
+    buf[p ++] = hex_encode(((uint8_t *)src)[i] >> 4);
+    buf[p ++] = hex_encode(((uint8_t *)src)[i] & 0xf);
   }
+  buf[p] = '\0';
 
-  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  gdb_send_pipelined(buf);
   free(buf);
 
+  return true;
+}
+
+// Read a single register with the number used by gdb, and return the
+// number of bytes of it, or 0 if QEMU does not provide it.
+int gdb_getreg(int no, uint64_t *val) {
+  char buf[32];
+  gdb_drain();
+  sprintf(buf, "p%x", no);
+  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
-  bool ok = !strcmp((const char*)reply, "OK");
+  int width = (size % 2 == 0 && size <= 16 ? size / 2 : 0);
+  int i;
+  *val = 0;
+  for (i = 0; i < width; i ++) {
+    *val |= (uint64_t)gdb_decode_hex(reply[i * 2], reply[i * 2 + 1]) << (i * 8);
+  }
   free(reply);
+  return width;
+}
 
-  return ok;
+// The reply is collected before the next packet whose reply is needed.
+bool gdb_setreg(int no, uint64_t val, int width) {
+  char buf[64];
+  int p = sprintf(buf, "P%x=", no);
+  int i;
+  for (i = 0; i < width; i ++, val >>= 8) {
+    buf[p ++] = hex_encode((val >> 4) & 0xf);
+    buf[p ++] = hex_encode(val & 0xf);
+  }
+  buf[p] = '\0';
+  gdb_send_pipelined(buf);
+  return true;
 }
 
 bool gdb_si() {
   char buf[] = "vCont;s:1";
   gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  // the writes before are done before stepping
+  gdb_drain();
   size_t size;
   uint8_t *reply = gdb_recv(conn, &size);
   free(reply);
   return true;
 }
 
+// QEMU ignores the kind of the breakpoint, and does not patch the memory.
+bool gdb_set_bp(uint32_t addr, bool insert) {
+  char buf[32];
+  sprintf(buf, "%c0,%x,4", (insert ? 'Z' : 'z'), addr);
+  gdb_send_pipelined(buf);
+  return true;
+}
+
+// Continue until a breakpoint is hit. If it is not hit within `timeout_ms`,
+// QEMU is interrupted, and false is returned.
+bool gdb_cont(int timeout_ms) {
+  // all replies are received before waiting for the stop reply
+  gdb_drain();
+  char buf[] = "vCont;c";
+  gdb_send(conn, (const uint8_t *)buf, strlen(buf));
+  if (!gdb_wait(conn, timeout_ms)) gdb_interrupt(conn);
+  size_t size;
+  uint8_t *reply = gdb_recv(conn, &size);
+  // an interruption is reported as SIGINT, and a breakpoint as SIGTRAP
+  bool hit = !strncmp((const char *)reply, "T05", 3);
+  free(reply);
+  return hit;
+}
+
 void gdb_exit() {
   gdb_end(conn);
 }
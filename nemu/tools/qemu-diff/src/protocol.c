@@ -28,6 +28,9 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+
+#include <poll.h>
 
 struct gdb_conn {
   FILE *in;
@@ -128,6 +131,24 @@ struct gdb_conn* gdb_begin_inet(const char *addr, uint16_t port) {
   return gdb_begin(fd);
 }
 
+struct gdb_conn* gdb_begin_unix(const char *path) {
+  struct sockaddr_un sa = {
+    .sun_family = AF_UNIX,
+  };
+  if (strlen(path) >= sizeof(sa.sun_path))
+    errx(1, "Socket path is too long: %s", path);
+  strcpy(sa.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(1, "socket");
+  if (connect(fd, (const struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  return gdb_begin(fd);
+}
 
 void gdb_end(struct gdb_conn *conn) {
   fclose(conn->in);
@@ -290,6 +311,17 @@ uint8_t* gdb_recv(struct gdb_conn *conn, size_t *size) {
   return reply;
 }
 
+bool gdb_wait(struct gdb_conn *conn, int timeout_ms) {
+  struct pollfd pfd = { .fd = fileno(conn->in), .events = POLLIN };
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+void gdb_interrupt(struct gdb_conn *conn) {
+  // a raw byte outside of packets
+  fputc(0x03, conn->out);
+  fflush(conn->out);
+}
+
 const char* gdb_start_noack(struct gdb_conn *conn) {
   static const char cmd[] = "QStartNoAckMode";
   gdb_send(conn, (const uint8_t *)cmd, sizeof(cmd) - 1);
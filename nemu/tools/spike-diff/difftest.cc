@@ -70,21 +70,57 @@ void sim_t::diff_set_regs(void* diff_context) {
   state->pc = ctx->pc;
 }
 
+// Copy between `buf` and the backing store of DRAM directly, if
+// [addr, addr + n) is inside DRAM. This is much faster than going
+// through the MMU byte by byte.
+static bool diff_bulk_copy(reg_t addr, void* buf, size_t n, bool to_ref) {
+  reg_t base = difftest_mem[0].first;
+  mem_t* mem = difftest_mem[0].second;
+  if (addr < base || addr - base > mem->size() || n > mem->size() - (addr - base)) return false;
+  return to_ref ? mem->store(addr - base, n, (const uint8_t*)buf)
+                : mem->load(addr - base, n, (uint8_t*)buf);
+}
+
 void sim_t::diff_memcpy(reg_t dest, void* src, size_t n) {
   mmu_t* mmu = p->get_mmu();
+  if (diff_bulk_copy(dest, src, n, true)) {
+    // the instructions decoded before may be overwritten
+    mmu->flush_icache();
+    return;
+  }
   for (size_t i = 0; i < n; i++) {
     mmu->store<uint8_t>(dest+i, *((uint8_t*)src+i));
   }
 }
 
+static void diff_memcpy_to_dut(reg_t src, void* dest, size_t n) {
+  if (diff_bulk_copy(src, dest, n, false)) return;
+  mmu_t* mmu = p->get_mmu();
+  for (size_t i = 0; i < n; i++) {
+    *((uint8_t*)dest+i) = mmu->load<uint8_t>(src+i);
+  }
+}
+
 extern "C" {
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
   if (direction == DIFFTEST_TO_REF) {
     s->diff_memcpy(addr, buf, n);
   } else {
-    assert(0);
+    diff_memcpy_to_dut(addr, buf, n);
+  }
+}
+
+__EXPORT uint64_t difftest_memhash(paddr_t addr, size_t n) {
+  // hash the page in place if the range does not cross pages
+  reg_t base = difftest_mem[0].first;
+  mem_t* mem = difftest_mem[0].second;
+  if (addr >= base && addr - base < mem->size() && (addr % PGSIZE) + n <= PGSIZE) {
+    return difftest_hash(mem->contents(addr - base), n);
   }
+  std::vector<uint8_t> buf(n);
+  diff_memcpy_to_dut(addr, buf.data(), n);
+  return difftest_hash(buf.data(), n);
 }
 
 __EXPORT void difftest_regcpy(void* dut, bool direction) {